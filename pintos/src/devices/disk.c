@@ -7,6 +7,7 @@
 #include "threads/io.h"
 #include "threads/interrupt.h"
 #include "threads/synch.h"
+#include "threads/vaddr.h"
 
 /* The code in this file is an interface to an ATA (IDE)
    controller.  It attempts to comply to [ATA-3]. */
@@ -48,6 +49,10 @@
 #define CMD_READ_SECTOR_RETRY 0x20      /* READ SECTOR with retries. */
 #define CMD_WRITE_SECTOR_RETRY 0x30     /* WRITE SECTOR with retries. */
 
+/* Most sectors transferred by one command.  A sector count of 0
+   in the Sector Count register means this many. */
+#define MULTIPLE_MAX 256
+
 /* An ATA device. */
 struct disk 
   {
@@ -86,7 +91,7 @@ static void reset_channel (struct channel *);
 static bool check_device_type (struct disk *);
 static void identify_ata_device (struct disk *);
 
-static void select_sector (struct disk *, disk_sector_t);
+static void select_sector (struct disk *, disk_sector_t, size_t cnt);
 static void issue_pio_command (struct channel *, uint8_t command);
 static void input_sector (struct channel *, void *);
 static void output_sector (struct channel *, const void *);
@@ -226,7 +231,7 @@ disk_read (struct disk *d, disk_sector_t sec_no, void *buffer)
 
   c = d->channel;
   lock_acquire (&c->lock);
-  select_sector (d, sec_no);
+  select_sector (d, sec_no, 1);
   issue_pio_command (c, CMD_READ_SECTOR_RETRY);
   sema_down (&c->completion_wait);
   if (!wait_while_busy (d))
@@ -236,6 +241,58 @@ disk_read (struct disk *d, disk_sector_t sec_no, void *buffer)
   lock_release (&c->lock);
 }
 
+/* Reads the CNT consecutive sectors starting at SEC_NO from disk
+   D into BUFFER, which must have room for CNT * DISK_SECTOR_SIZE
+   bytes.  Up to MULTIPLE_MAX sectors are read with a single
+   command, which saves issuing one command and waiting for the
+   disk to seek for each of them.
+   Internally synchronizes accesses to disks, so external
+   per-disk locking is unneeded.
+
+   BUFFER must be in kernel memory.  The data is copied into it
+   while the channel lock is held, so a page fault on a user page
+   there could need the same channel to bring the page in. */
+void
+disk_read_multiple (struct disk *d, disk_sector_t sec_no, size_t cnt,
+                    void *buffer_)
+{
+  uint8_t *buffer = buffer_;
+  struct channel *c;
+
+  ASSERT (d != NULL);
+  ASSERT (!is_user_vaddr (buffer));
+  ASSERT (buffer != NULL);
+  ASSERT (sec_no + cnt <= d->capacity);
+
+  c = d->channel;
+  while (cnt > 0)
+    {
+      size_t n = cnt < MULTIPLE_MAX ? cnt : MULTIPLE_MAX;
+      size_t i;
+
+      lock_acquire (&c->lock);
+      select_sector (d, sec_no, n);
+      issue_pio_command (c, CMD_READ_SECTOR_RETRY);
+
+      /* The disk interrupts once for each sector, as soon as the
+         sector is ready to be read. */
+      for (i = 0; i < n; i++)
+        {
+          sema_down (&c->completion_wait);
+          if (!wait_while_busy (d))
+            PANIC ("%s: disk read failed, sector=%"PRDSNu,
+                   d->name, sec_no + i);
+          input_sector (c, buffer + i * DISK_SECTOR_SIZE);
+        }
+      d->read_cnt += n;
+      lock_release (&c->lock);
+
+      sec_no += n;
+      buffer += n * DISK_SECTOR_SIZE;
+      cnt -= n;
+    }
+}
+
 /* Write sector SEC_NO to disk D from BUFFER, which must contain
    DISK_SECTOR_SIZE bytes.  Returns after the disk has
    acknowledged receiving the data.
@@ -251,7 +308,7 @@ disk_write (struct disk *d, disk_sector_t sec_no, const void *buffer)
 
   c = d->channel;
   lock_acquire (&c->lock);
-  select_sector (d, sec_no);
+  select_sector (d, sec_no, 1);
   issue_pio_command (c, CMD_WRITE_SECTOR_RETRY);
   if (!wait_while_busy (d))
     PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no);
@@ -426,18 +483,19 @@ print_ata_string (char *string, size_t size)
 }
 
 /* Selects device D, waiting for it to become ready, and then
-   writes SEC_NO to the disk's sector selection registers.  (We
-   use LBA mode.) */
+   writes SEC_NO and CNT, the number of sectors to transfer, to
+   the disk's sector selection registers.  (We use LBA mode.) */
 static void
-select_sector (struct disk *d, disk_sector_t sec_no) 
+select_sector (struct disk *d, disk_sector_t sec_no, size_t cnt) 
 {
   struct channel *c = d->channel;
 
   ASSERT (sec_no < d->capacity);
   ASSERT (sec_no < (1UL << 28));
+  ASSERT (cnt >= 1 && cnt <= MULTIPLE_MAX);
   
   select_device_wait (d);
-  outb (reg_nsect (c), 1);
+  outb (reg_nsect (c), cnt == MULTIPLE_MAX ? 0 : cnt);
   outb (reg_lbal (c), sec_no);
   outb (reg_lbam (c), sec_no >> 8);
   outb (reg_lbah (c), (sec_no >> 16));
@@ -2,6 +2,7 @@
 #define DEVICES_DISK_H
 
 #include <inttypes.h>
+#include <stddef.h>
 #include <stdint.h>
 
 /* Size of a disk sector in bytes. */
@@ -21,6 +22,7 @@ void disk_print_stats (void);
 struct disk *disk_get (int chan_no, int dev_no);
 disk_sector_t disk_size (struct disk *);
 void disk_read (struct disk *, disk_sector_t, void *);
+void disk_read_multiple (struct disk *, disk_sector_t, size_t cnt, void *);
 void disk_write (struct disk *, disk_sector_t, const void *);
 
 #endif /* devices/disk.h */
@@ -0,0 +1,658 @@
+#include "filesys/cache.h"
+#include <debug.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "devices/timer.h"
+#include "filesys/filesys.h"
+#include "filesys/inode.h"
+#include "filesys/journal.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+
+/* The buffer cache keeps CACHE_SIZE sectors of the file system
+   disk in memory.  Reads of cached sectors never touch the disk
+   and writes only mark the cached copy dirty; dirty sectors are
+   written back when they are evicted or when the cache is
+   flushed.  Victims are chosen by the clock algorithm.
+
+   Synchronization works at two levels.  CACHE_LOCK protects the
+   mapping from sectors to entries, that is, each entry's
+   `sector', `valid', `users', `accessed' and `evicting' members
+   and the clock hand.  Each entry's data is protected by its own
+   readers-writer lock, so any number of threads can read a hot
+   sector at once.  An entry with nonzero `users' is pinned: it
+   cannot be evicted, so its sector cannot change underneath a
+   thread that is waiting for or holding its data lock.  Disk I/O
+   is never done while holding CACHE_LOCK.
+
+   A sector changed through the journal is "logged": its cached
+   copy is newer than the disk, but it must not be written back
+   until the journal has committed and checkpointed it, so the
+   cache never writes it.  Evicting it just drops it; the journal
+   supplies its contents again if it is read back in. */
+
+/* A cached sector. */
+struct cache_entry
+  {
+    disk_sector_t sector;               /* Sector cached, if valid. */
+    bool valid;                         /* Does this entry hold a sector? */
+    bool dirty;                         /* Modified since read from disk? */
+    bool logged;                        /* Held back for the journal? */
+    bool accessed;                      /* Used since clock hand passed? */
+    int users;                          /* Threads using or waiting. */
+
+    /* While the previous contents of this entry are being written
+       back to disk, EVICTING is true and OLD_SECTOR is their
+       sector.  Reads of OLD_SECTOR must wait for the write. */
+    bool evicting;
+    disk_sector_t old_sector;
+
+    struct rwlock rwlock;               /* Protects DATA and DIRTY. */
+    uint8_t *data;                      /* DISK_SECTOR_SIZE bytes. */
+  };
+
+static struct cache_entry cache[CACHE_SIZE];
+static struct lock cache_lock;
+static struct condition cache_changed;  /* Entry unpinned or evicted. */
+static size_t clock_hand;
+
+/* Read-ahead queue: sectors waiting to be brought into the
+   cache by the read-ahead thread.  Protected by CACHE_LOCK.
+   Requests that don't fit are dropped: read-ahead is only a
+   hint. */
+#define READAHEAD_MAX 16
+static disk_sector_t readahead_queue[READAHEAD_MAX];
+static size_t readahead_head, readahead_cnt;
+static struct condition readahead_ready; /* Queue became nonempty. */
+
+/* The read-ahead thread takes up to READAHEAD_BATCH consecutive
+   sectors off the queue at a time and reads those that are not
+   cached with a single disk command, into READAHEAD_BUF, from
+   which they are copied into their cache entries. */
+#define READAHEAD_BATCH (PGSIZE / DISK_SECTOR_SIZE)
+static uint8_t *readahead_buf;
+
+/* Timer ticks between periodic flushes of dirty sectors by the
+   write-behind thread, or 0 to flush only on eviction and
+   shutdown.  Set with the -flush=TICKS kernel option. */
+int64_t cache_flush_interval = 5 * TIMER_FREQ;
+
+/* Held by the write-behind thread while it flushes, so that
+   cache_stop_flushing() can wait for a flush in progress.  Once
+   FLUSH_STOPPED is set, the thread exits instead of flushing
+   again. */
+static struct lock flush_lock;
+static bool flush_stopped;
+
+/* Statistics. */
+static long long hit_cnt, miss_cnt, direct_cnt;
+
+static struct cache_entry *cache_get (disk_sector_t, bool exclusive,
+                                      bool need_data);
+static void cache_put (struct cache_entry *, bool exclusive);
+static void write_sector (disk_sector_t, const void *, size_t ofs,
+                          size_t size, bool logged);
+static struct cache_entry *lookup (disk_sector_t);
+static bool is_evicting (disk_sector_t);
+static struct cache_entry *choose_victim (void);
+static bool claim (struct cache_entry *, disk_sector_t);
+static void write_back (struct cache_entry *);
+static size_t load_batch (disk_sector_t, size_t cnt);
+static thread_func readahead_thread NO_RETURN;
+static thread_func flush_thread;
+
+/* Initializes the buffer cache. */
+void
+cache_init (void)
+{
+  uint8_t *data;
+  size_t i;
+
+  data = palloc_get_multiple (PAL_ASSERT,
+                              CACHE_SIZE * DISK_SECTOR_SIZE / PGSIZE);
+  for (i = 0; i < CACHE_SIZE; i++)
+    {
+      struct cache_entry *e = &cache[i];
+      e->valid = false;
+      e->dirty = false;
+      e->logged = false;
+      e->accessed = false;
+      e->users = 0;
+      e->evicting = false;
+      rwlock_init (&e->rwlock);
+      e->data = data + i * DISK_SECTOR_SIZE;
+    }
+  lock_init (&cache_lock);
+  cond_init (&cache_changed);
+  clock_hand = 0;
+
+  cond_init (&readahead_ready);
+  readahead_head = readahead_cnt = 0;
+  readahead_buf = palloc_get_page (PAL_ASSERT);
+  thread_create ("read-ahead", PRI_DEFAULT, readahead_thread, NULL);
+  lock_init (&flush_lock);
+  flush_stopped = false;
+  if (cache_flush_interval > 0)
+    thread_create ("write-behind", PRI_DEFAULT, flush_thread, NULL);
+}
+
+/* Stops the write-behind thread, waiting for a flush that it
+   has under way to finish.  Called at shutdown before the free
+   map is closed, so that the thread cannot allocate sectors or
+   commit after the file system has been marked clean. */
+void
+cache_stop_flushing (void)
+{
+  lock_acquire (&flush_lock);
+  flush_stopped = true;
+  lock_release (&flush_lock);
+}
+
+/* Writes every dirty cached sector that is not logged back to
+   disk, in ascending sector order so that the disk head sweeps
+   across the disk once instead of seeking back and forth. */
+void
+cache_flush (void)
+{
+  struct cache_entry *dirty[CACHE_SIZE];
+  size_t dirty_cnt = 0;
+  size_t i;
+
+  /* Pin the dirty entries, sorting them by sector with an
+     insertion sort, which is plenty for CACHE_SIZE entries. */
+  lock_acquire (&cache_lock);
+  for (i = 0; i < CACHE_SIZE; i++)
+    {
+      struct cache_entry *e = &cache[i];
+      size_t j;
+
+      if (!e->valid || !e->dirty || e->logged)
+        continue;
+      e->users++;
+      for (j = dirty_cnt++; j > 0 && dirty[j - 1]->sector > e->sector; j--)
+        dirty[j] = dirty[j - 1];
+      dirty[j] = e;
+    }
+  lock_release (&cache_lock);
+
+  for (i = 0; i < dirty_cnt; i++)
+    {
+      struct cache_entry *e = dirty[i];
+
+      /* Holding the data lock for reading keeps writers out, so
+         nobody can dirty the entry again while we write it. */
+      rwlock_acquire_read (&e->rwlock);
+      if (e->dirty && !e->logged)
+        {
+          e->dirty = false;
+          disk_write (filesys_disk, e->sector, e->data);
+        }
+      cache_put (e, false);
+    }
+}
+
+/* Prints buffer cache statistics. */
+void
+cache_print_stats (void)
+{
+  printf ("Cache: %lld hits, %lld misses, %lld read directly\n",
+          hit_cnt, miss_cnt, direct_cnt);
+}
+
+/* Copies SIZE bytes starting at offset OFS within SECTOR into
+   BUFFER. */
+void
+cache_read (disk_sector_t sector, void *buffer, size_t ofs, size_t size)
+{
+  struct cache_entry *e;
+
+  ASSERT (ofs + size <= DISK_SECTOR_SIZE);
+
+  e = cache_get (sector, false, true);
+  memcpy (buffer, e->data + ofs, size);
+  cache_put (e, false);
+}
+
+/* Copies the CNT whole sectors starting at SECTOR into BUFFER.
+   Sectors that are cached are copied from the cache.  Runs of
+   sectors that are not are read from disk straight into BUFFER,
+   each with a single disk command, without passing through the
+   cache or displacing anything in it.
+
+   Must not be used for sectors that might be logged, because
+   their latest contents may be neither cached nor on disk.
+   BUFFER must be in kernel memory, as for disk_read_multiple(),
+   never a user buffer that could fault. */
+void
+cache_read_sectors (disk_sector_t sector, size_t cnt, void *buffer_)
+{
+  uint8_t *buffer = buffer_;
+
+  ASSERT (!is_user_vaddr (buffer));
+
+  while (cnt > 0)
+    {
+      size_t n;
+
+      /* Count the uncached sectors at the start.  A sector that
+         is on its way out of the cache doesn't count: the disk
+         does not have its latest contents yet. */
+      lock_acquire (&cache_lock);
+      for (n = 0; n < cnt; n++)
+        if (lookup (sector + n) != NULL || is_evicting (sector + n))
+          break;
+      direct_cnt += n;
+      lock_release (&cache_lock);
+
+      if (n > 0)
+        disk_read_multiple (filesys_disk, sector, n, buffer);
+      else
+        {
+          cache_read (sector, buffer, 0, DISK_SECTOR_SIZE);
+          n = 1;
+        }
+      sector += n;
+      buffer += n * DISK_SECTOR_SIZE;
+      cnt -= n;
+    }
+}
+
+/* Copies SIZE bytes from BUFFER into SECTOR, starting at offset
+   OFS within the sector.  Overwriting a whole sector does not
+   read it from disk first. */
+void
+cache_write (disk_sector_t sector, const void *buffer, size_t ofs,
+             size_t size)
+{
+  write_sector (sector, buffer, ofs, size, false);
+}
+
+/* Like cache_write(), but for a sector that has just been
+   allocated, whose old contents do not matter: the rest of the
+   sector, outside OFS through OFS + SIZE, is set to zeros
+   instead of being read from disk. */
+void
+cache_write_zeroed (disk_sector_t sector, const void *buffer, size_t ofs,
+                    size_t size)
+{
+  struct cache_entry *e;
+
+  ASSERT (ofs + size <= DISK_SECTOR_SIZE);
+
+  e = cache_get (sector, true, false);
+  memset (e->data, 0, ofs);
+  memcpy (e->data + ofs, buffer, size);
+  memset (e->data + ofs + size, 0, DISK_SECTOR_SIZE - (ofs + size));
+  e->dirty = true;
+  e->logged = false;
+  cache_put (e, true);
+}
+
+/* Like cache_write(), but for a sector whose change has been
+   recorded by the journal, which marks the sector logged. */
+void
+cache_write_logged (disk_sector_t sector, const void *buffer, size_t ofs,
+                    size_t size)
+{
+  write_sector (sector, buffer, ofs, size, true);
+}
+
+/* Marks SECTOR, if cached and logged, as no longer logged and
+   clean, because the journal has written its cached contents
+   home. */
+void
+cache_unlog (disk_sector_t sector)
+{
+  struct cache_entry *e;
+
+  lock_acquire (&cache_lock);
+  e = lookup (sector);
+  if (e != NULL)
+    e->users++;
+  lock_release (&cache_lock);
+  if (e == NULL)
+    return;
+
+  rwlock_acquire_write (&e->rwlock);
+  if (e->logged)
+    {
+      e->logged = false;
+      e->dirty = false;
+    }
+  cache_put (e, true);
+}
+
+/* Asks for SECTOR to be brought into the cache in the
+   background, so that a later cache_read() of it is a hit.
+   Returns without waiting for the disk.  A sector that is
+   already cached or queued is not queued again. */
+void
+cache_readahead (disk_sector_t sector)
+{
+  size_t i;
+
+  lock_acquire (&cache_lock);
+  for (i = 0; i < readahead_cnt; i++)
+    if (readahead_queue[(readahead_head + i) % READAHEAD_MAX] == sector)
+      break;
+  if (i == readahead_cnt && readahead_cnt < READAHEAD_MAX
+      && lookup (sector) == NULL)
+    {
+      size_t tail = (readahead_head + readahead_cnt) % READAHEAD_MAX;
+      readahead_queue[tail] = sector;
+      readahead_cnt++;
+      cond_signal (&readahead_ready, &cache_lock);
+    }
+  lock_release (&cache_lock);
+}
+
+/* Read-ahead thread.  Loads the sectors queued by
+   cache_readahead() into the cache, taking each run of
+   consecutive sectors in the queue as a batch. */
+static void
+readahead_thread (void *aux UNUSED)
+{
+  for (;;)
+    {
+      disk_sector_t sector;
+      size_t cnt;
+
+      lock_acquire (&cache_lock);
+      while (readahead_cnt == 0)
+        cond_wait (&readahead_ready, &cache_lock);
+      sector = readahead_queue[readahead_head];
+      cnt = 0;
+      do
+        {
+          readahead_head = (readahead_head + 1) % READAHEAD_MAX;
+          readahead_cnt--;
+          cnt++;
+        }
+      while (readahead_cnt > 0 && cnt < READAHEAD_BATCH
+             && readahead_queue[readahead_head] == sector + cnt);
+      lock_release (&cache_lock);
+
+      /* A sector that can't start a batch, because it is cached
+         already or no entry is free, is loaded on its own. */
+      while (cnt > 0)
+        {
+          size_t n = load_batch (sector, cnt);
+          if (n == 0)
+            {
+              cache_put (cache_get (sector, false, true), false);
+              n = 1;
+            }
+          sector += n;
+          cnt -= n;
+        }
+    }
+}
+
+/* Loads as many as possible of the CNT consecutive sectors
+   starting at SECTOR into the cache, stopping at the first one
+   that is cached or on its way out of the cache already or for
+   which no entry is free.  Those that are loaded are read from
+   disk with a single command.  Returns the number loaded.  Only
+   the read-ahead thread may call this, because it uses
+   READAHEAD_BUF. */
+static size_t
+load_batch (disk_sector_t sector, size_t cnt)
+{
+  struct cache_entry *batch[READAHEAD_BATCH];
+  bool dirty[READAHEAD_BATCH];
+  size_t n, i;
+
+  ASSERT (cnt <= READAHEAD_BATCH);
+
+  lock_acquire (&cache_lock);
+  for (n = 0; n < cnt; n++)
+    {
+      struct cache_entry *e;
+
+      if (lookup (sector + n) != NULL || is_evicting (sector + n))
+        break;
+      e = choose_victim ();
+      if (e == NULL)
+        break;
+      dirty[n] = claim (e, sector + n);
+      batch[n] = e;
+    }
+  miss_cnt += n;
+  lock_release (&cache_lock);
+
+  if (n == 0)
+    return 0;
+  for (i = 0; i < n; i++)
+    if (dirty[i])
+      write_back (batch[i]);
+  disk_read_multiple (filesys_disk, sector, n, readahead_buf);
+  for (i = 0; i < n; i++)
+    {
+      struct cache_entry *e = batch[i];
+
+      if (!journal_read (e->sector, e->data))
+        memcpy (e->data, readahead_buf + i * DISK_SECTOR_SIZE,
+                DISK_SECTOR_SIZE);
+      e->dirty = false;
+      e->logged = false;
+      cache_put (e, true);
+    }
+  return n;
+}
+
+/* Write-behind thread.  Gives delayed file data its sectors,
+   commits the journal and flushes dirty sectors to disk every
+   CACHE_FLUSH_INTERVAL ticks, which bounds how much a crash can
+   lose and how much is left to write at shutdown.  Exits once
+   cache_stop_flushing() has been called. */
+static void
+flush_thread (void *aux UNUSED)
+{
+  for (;;)
+    {
+      timer_sleep (cache_flush_interval);
+      lock_acquire (&flush_lock);
+      if (flush_stopped)
+        {
+          lock_release (&flush_lock);
+          return;
+        }
+      inode_flush_delayed ();
+      journal_commit ();
+      cache_flush ();
+      lock_release (&flush_lock);
+    }
+}
+
+/* Copies SIZE bytes from BUFFER into SECTOR at offset OFS and
+   marks the sector dirty, and logged if LOGGED is true. */
+static void
+write_sector (disk_sector_t sector, const void *buffer, size_t ofs,
+              size_t size, bool logged)
+{
+  struct cache_entry *e;
+
+  ASSERT (ofs + size <= DISK_SECTOR_SIZE);
+
+  e = cache_get (sector, true, size < DISK_SECTOR_SIZE);
+  memcpy (e->data + ofs, buffer, size);
+  e->dirty = true;
+  e->logged = logged;
+  cache_put (e, true);
+}
+
+/* Returns the pinned cache entry for SECTOR, loading it into the
+   cache if necessary, with its data lock held for writing if
+   EXCLUSIVE is true, for reading otherwise.  If SECTOR is not
+   cached and NEED_DATA is false, then the caller is going to
+   overwrite the whole sector, so its old contents are not read
+   from disk.  The caller must release the entry with
+   cache_put(). */
+static struct cache_entry *
+cache_get (disk_sector_t sector, bool exclusive, bool need_data)
+{
+  struct cache_entry *e;
+  bool dirty;
+
+  lock_acquire (&cache_lock);
+  for (;;)
+    {
+      e = lookup (sector);
+      if (e != NULL)
+        {
+          /* Hit.  If the entry is still being loaded, its loader
+             holds the data lock and we wait for it there. */
+          e->users++;
+          e->accessed = true;
+          hit_cnt++;
+          lock_release (&cache_lock);
+          if (exclusive)
+            rwlock_acquire_write (&e->rwlock);
+          else
+            rwlock_acquire_read (&e->rwlock);
+          return e;
+        }
+
+      /* Don't read SECTOR from disk while a newer copy of it is
+         still on its way out of the cache. */
+      if (!is_evicting (sector))
+        {
+          e = choose_victim ();
+          if (e != NULL)
+            break;
+        }
+      cond_wait (&cache_changed, &cache_lock);
+    }
+
+  /* Miss.  Take over victim E for SECTOR. */
+  miss_cnt++;
+  dirty = claim (e, sector);
+  lock_release (&cache_lock);
+
+  if (dirty)
+    write_back (e);
+  if (need_data && !journal_read (sector, e->data))
+    disk_read (filesys_disk, sector, e->data);
+  e->dirty = false;
+  e->logged = false;
+
+  if (!exclusive)
+    {
+      rwlock_release_write (&e->rwlock);
+      rwlock_acquire_read (&e->rwlock);
+    }
+  return e;
+}
+
+/* Takes over victim E, chosen by choose_victim(), for SECTOR,
+   pinning it and acquiring its data lock for writing.  E is
+   unpinned, so nobody holds its data lock and acquiring it
+   cannot block.  Returns true if E holds dirty data for another
+   sector, in which case it is marked as evicting that sector and
+   the caller must call write_back(), without holding CACHE_LOCK,
+   before using E.  CACHE_LOCK must be held. */
+static bool
+claim (struct cache_entry *e, disk_sector_t sector)
+{
+  bool dirty;
+
+  ASSERT (lock_held_by_current_thread (&cache_lock));
+
+  dirty = e->valid && e->dirty && !e->logged;
+  e->evicting = dirty;
+  e->old_sector = e->sector;
+  e->sector = sector;
+  e->valid = true;
+  e->accessed = true;
+  e->users++;
+  rwlock_acquire_write (&e->rwlock);
+  return dirty;
+}
+
+/* Writes the dirty old contents of entry E, just claimed with
+   claim(), back to their sector. */
+static void
+write_back (struct cache_entry *e)
+{
+  disk_write (filesys_disk, e->old_sector, e->data);
+  lock_acquire (&cache_lock);
+  e->evicting = false;
+  cond_broadcast (&cache_changed, &cache_lock);
+  lock_release (&cache_lock);
+}
+
+/* Releases entry E, obtained from cache_get() with the same
+   EXCLUSIVE argument. */
+static void
+cache_put (struct cache_entry *e, bool exclusive)
+{
+  if (exclusive)
+    rwlock_release_write (&e->rwlock);
+  else
+    rwlock_release_read (&e->rwlock);
+
+  lock_acquire (&cache_lock);
+  ASSERT (e->users > 0);
+  if (--e->users == 0)
+    cond_broadcast (&cache_changed, &cache_lock);
+  lock_release (&cache_lock);
+}
+
+/* Returns the entry that caches SECTOR, or a null pointer if
+   SECTOR is not cached.  CACHE_LOCK must be held. */
+static struct cache_entry *
+lookup (disk_sector_t sector)
+{
+  size_t i;
+
+  ASSERT (lock_held_by_current_thread (&cache_lock));
+
+  for (i = 0; i < CACHE_SIZE; i++)
+    if (cache[i].valid && cache[i].sector == sector)
+      return &cache[i];
+  return NULL;
+}
+
+/* Returns true if an older copy of SECTOR is being written back
+   to disk.  CACHE_LOCK must be held. */
+static bool
+is_evicting (disk_sector_t sector)
+{
+  size_t i;
+
+  ASSERT (lock_held_by_current_thread (&cache_lock));
+
+  for (i = 0; i < CACHE_SIZE; i++)
+    if (cache[i].evicting && cache[i].old_sector == sector)
+      return true;
+  return false;
+}
+
+/* Chooses an unpinned entry to evict, using the clock algorithm,
+   and returns it, or returns a null pointer if every entry is
+   pinned.  CACHE_LOCK must be held. */
+static struct cache_entry *
+choose_victim (void)
+{
+  size_t i;
+
+  ASSERT (lock_held_by_current_thread (&cache_lock));
+
+  /* Two trips around the clock are enough: the first clears
+     every accessed bit it passes. */
+  for (i = 0; i < 2 * CACHE_SIZE; i++)
+    {
+      struct cache_entry *e = &cache[clock_hand];
+      clock_hand = (clock_hand + 1) % CACHE_SIZE;
+
+      if (e->users > 0 || e->evicting)
+        continue;
+      if (!e->valid || !e->accessed)
+        return e;
+      e->accessed = false;
+    }
+  return NULL;
+}
@@ -0,0 +1,29 @@
+#ifndef FILESYS_CACHE_H
+#define FILESYS_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "devices/disk.h"
+
+/* Number of sectors held in the buffer cache. */
+#define CACHE_SIZE 64
+
+/* Timer ticks between periodic flushes, or 0 to disable. */
+extern int64_t cache_flush_interval;
+
+void cache_init (void);
+void cache_flush (void);
+void cache_stop_flushing (void);
+void cache_print_stats (void);
+
+void cache_read (disk_sector_t, void *buffer, size_t ofs, size_t size);
+void cache_read_sectors (disk_sector_t, size_t cnt, void *buffer);
+void cache_write (disk_sector_t, const void *buffer, size_t ofs, size_t size);
+void cache_write_zeroed (disk_sector_t, const void *buffer, size_t ofs,
+                         size_t size);
+void cache_write_logged (disk_sector_t, const void *buffer, size_t ofs,
+                         size_t size);
+void cache_unlog (disk_sector_t);
+void cache_readahead (disk_sector_t);
+
+#endif /* filesys/cache.h */
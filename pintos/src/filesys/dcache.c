@@ -0,0 +1,194 @@
+#include "filesys/dcache.h"
+#include <debug.h>
+#include <hash.h>
+#include <list.h>
+#include <stdio.h>
+#include <string.h>
+#include "filesys/directory.h"
+#include "threads/synch.h"
+
+/* The dentry cache remembers the results of recent directory
+   lookups, so that resolving the same names again does not read
+   the directories.  Each entry maps a directory's inode sector
+   and a name to the inode sector of the file by that name, or to
+   0 if the directory has no such file (a negative entry).
+
+   directory.c keeps the cache coherent: it records what each
+   lookup found, records a positive entry when it adds a name and
+   a negative one when it removes it, and drops everything cached
+   under a directory whose inode may be reused.
+
+   Entries are recycled in least-recently-used order. */
+
+/* A cached directory entry. */
+struct dentry
+  {
+    struct hash_elem hash_elem;         /* Element in DENTRIES, if used. */
+    struct list_elem lru_elem;          /* Element in LRU. */
+    bool in_use;                        /* In DENTRIES? */
+    disk_sector_t dir;                  /* Directory's inode sector. */
+    char name[NAME_MAX + 1];            /* Name within DIR. */
+    disk_sector_t sector;               /* File's inode sector, or 0. */
+  };
+
+static struct dentry dentry_pool[DCACHE_SIZE];
+static struct hash dentries;            /* In-use entries by DIR and NAME. */
+static struct list lru;                 /* All entries, most recent first. */
+static struct lock dcache_lock;         /* Protects everything above. */
+
+/* Statistics. */
+static long long hit_cnt, miss_cnt;
+
+static hash_hash_func dentry_hash;
+static hash_less_func dentry_less;
+static struct dentry *find (disk_sector_t dir, const char *name);
+static void forget (struct dentry *);
+
+/* Initializes the dentry cache. */
+void
+dcache_init (void)
+{
+  size_t i;
+
+  if (!hash_init (&dentries, dentry_hash, dentry_less, NULL))
+    PANIC ("dentry cache initialization failed");
+  list_init (&lru);
+  lock_init (&dcache_lock);
+  for (i = 0; i < DCACHE_SIZE; i++)
+    list_push_back (&lru, &dentry_pool[i].lru_elem);
+}
+
+/* Looks up NAME in the directory whose inode is in sector DIR.
+   If the answer is cached, returns true and sets *SECTOR to the
+   named file's inode sector, or to 0 if DIR has no file by that
+   name.  Returns false if the answer is not cached. */
+bool
+dcache_lookup (disk_sector_t dir, const char *name, disk_sector_t *sector)
+{
+  struct dentry *d;
+
+  if (strlen (name) > NAME_MAX)
+    return false;
+
+  lock_acquire (&dcache_lock);
+  d = find (dir, name);
+  if (d != NULL)
+    {
+      *sector = d->sector;
+      list_remove (&d->lru_elem);
+      list_push_front (&lru, &d->lru_elem);
+      hit_cnt++;
+    }
+  else
+    miss_cnt++;
+  lock_release (&dcache_lock);
+
+  return d != NULL;
+}
+
+/* Records that NAME, in the directory whose inode is in sector
+   DIR, refers to the inode in SECTOR, or that there is no file
+   by that name if SECTOR is 0.  Replaces any entry already
+   cached for NAME in DIR.  Names too long to be valid are not
+   cached. */
+void
+dcache_insert (disk_sector_t dir, const char *name, disk_sector_t sector)
+{
+  struct dentry *d;
+
+  if (strlen (name) > NAME_MAX)
+    return;
+
+  lock_acquire (&dcache_lock);
+  d = find (dir, name);
+  if (d == NULL)
+    {
+      /* Recycle the least recently used entry. */
+      d = list_entry (list_back (&lru), struct dentry, lru_elem);
+      forget (d);
+      d->dir = dir;
+      strlcpy (d->name, name, sizeof d->name);
+      hash_insert (&dentries, &d->hash_elem);
+      d->in_use = true;
+    }
+  d->sector = sector;
+  list_remove (&d->lru_elem);
+  list_push_front (&lru, &d->lru_elem);
+  lock_release (&dcache_lock);
+}
+
+/* Forgets every entry cached for the directory whose inode is in
+   sector DIR.  Must be called before that sector can be reused
+   for another directory. */
+void
+dcache_remove_dir (disk_sector_t dir)
+{
+  size_t i;
+
+  lock_acquire (&dcache_lock);
+  for (i = 0; i < DCACHE_SIZE; i++)
+    {
+      struct dentry *d = &dentry_pool[i];
+      if (d->in_use && d->dir == dir)
+        {
+          forget (d);
+          list_remove (&d->lru_elem);
+          list_push_back (&lru, &d->lru_elem);
+        }
+    }
+  lock_release (&dcache_lock);
+}
+
+/* Prints dentry cache statistics. */
+void
+dcache_print_stats (void)
+{
+  printf ("Dentry cache: %lld hits, %lld misses\n", hit_cnt, miss_cnt);
+}
+
+/* Returns the in-use entry for NAME in DIR, or a null pointer if
+   there is none.  The caller must hold DCACHE_LOCK. */
+static struct dentry *
+find (disk_sector_t dir, const char *name)
+{
+  struct dentry key;
+  struct hash_elem *e;
+
+  key.dir = dir;
+  strlcpy (key.name, name, sizeof key.name);
+  e = hash_find (&dentries, &key.hash_elem);
+  return e != NULL ? hash_entry (e, struct dentry, hash_elem) : NULL;
+}
+
+/* Removes D from DENTRIES, if it is there.  The caller must hold
+   DCACHE_LOCK. */
+static void
+forget (struct dentry *d)
+{
+  if (d->in_use)
+    {
+      hash_delete (&dentries, &d->hash_elem);
+      d->in_use = false;
+    }
+}
+
+/* Returns a hash value for dentry D. */
+static unsigned
+dentry_hash (const struct hash_elem *d_, void *aux UNUSED)
+{
+  const struct dentry *d = hash_entry (d_, struct dentry, hash_elem);
+  return hash_string (d->name) ^ hash_int (d->dir);
+}
+
+/* Returns true if dentry A precedes dentry B. */
+static bool
+dentry_less (const struct hash_elem *a_, const struct hash_elem *b_,
+             void *aux UNUSED)
+{
+  const struct dentry *a = hash_entry (a_, struct dentry, hash_elem);
+  const struct dentry *b = hash_entry (b_, struct dentry, hash_elem);
+
+  if (a->dir != b->dir)
+    return a->dir < b->dir;
+  return strcmp (a->name, b->name) < 0;
+}
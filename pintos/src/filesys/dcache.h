@@ -0,0 +1,17 @@
+#ifndef FILESYS_DCACHE_H
+#define FILESYS_DCACHE_H
+
+#include <stdbool.h>
+#include "devices/disk.h"
+
+/* Number of directory entries remembered by the dentry cache. */
+#define DCACHE_SIZE 128
+
+void dcache_init (void);
+bool dcache_lookup (disk_sector_t dir, const char *name,
+                    disk_sector_t *sector);
+void dcache_insert (disk_sector_t dir, const char *name, disk_sector_t sector);
+void dcache_remove_dir (disk_sector_t dir);
+void dcache_print_stats (void);
+
+#endif /* filesys/dcache.h */
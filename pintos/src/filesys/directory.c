@@ -1,9 +1,13 @@
 #include "filesys/directory.h"
 #include <stdio.h>
 #include <string.h>
+#include <hash.h>
 #include <list.h>
+#include <round.h>
+#include "filesys/dcache.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
 #include "threads/malloc.h"
 
 /* A directory. */
@@ -21,12 +25,85 @@ struct dir_entry
     bool in_use;                        /* In use or free? */
   };
 
+/* A directory small enough to fit in one sector is a plain array
+   of entries, searched linearly.  When it outgrows that, it is
+   converted to a hash table: the first sector of the directory
+   holds a struct dir_header, and each following sector is a
+   bucket of ENTRIES_PER_BUCKET entries.  A name is looked up in
+   the bucket its hash selects, and in the buckets after that
+   one only while they have no never-used slot (linear probing,
+   one bucket at a time), so a lookup usually reads one sector.
+
+   The two layouts are told apart by the header: a hashed
+   directory is at least a sector long and starts with DIR_MAGIC.
+   A linear directory is normally shorter than a sector, but a
+   conversion that ran out of disk space can leave it longer,
+   with nothing but never-used slots after the first sector.
+
+   A slot that has never been used has a zero inode_sector.  A
+   removed entry keeps its inode_sector, so that probing
+   continues past it. */
+
+/* Identifies a hashed directory. */
+#define DIR_MAGIC 0x48444952
+
+/* Directory entries per bucket sector. */
+#define ENTRIES_PER_BUCKET (DISK_SECTOR_SIZE / sizeof (struct dir_entry))
+
+/* Number of buckets a directory starts with when it is hashed,
+   and the most it grows to.  Growing the table rewrites all of
+   it in one journal operation, so MAX_BUCKETS keeps that within
+   what an operation may change (see journal.c).  A directory
+   that big fills up at MAX_BUCKETS * ENTRIES_PER_BUCKET
+   entries. */
+#define MIN_BUCKETS 4
+#define MAX_BUCKETS 32
+
+/* Header of a hashed directory, in its first sector. */
+struct dir_header
+  {
+    unsigned magic;                     /* Magic number. */
+    uint32_t bucket_cnt;                /* Number of buckets. */
+    uint32_t entry_cnt;                 /* Entries in use. */
+    uint32_t used_cnt;                  /* Entries in use or removed. */
+  };
+
+static bool is_hashed (const struct dir *);
+static bool read_header (const struct dir *, struct dir_header *);
+static bool write_header (struct dir *, const struct dir_header *);
+static bool probe (const struct dir *, const struct dir_header *,
+                   const char *name, struct dir_entry *ep, off_t *ofsp,
+                   off_t *freep);
+static bool hashed_add (struct dir *, const char *name,
+                        disk_sector_t inode_sector);
+static bool rebuild (struct dir *, uint32_t bucket_cnt);
+static bool next_slot (struct dir *, bool hashed, off_t *pos,
+                       struct dir_entry *);
+
 /* Creates a directory with space for ENTRY_CNT entries in the
    given SECTOR.  Returns true if successful, false on failure. */
 bool
 dir_create (disk_sector_t sector, size_t entry_cnt) 
 {
-  return inode_create (sector, entry_cnt * sizeof (struct dir_entry));
+  struct dir *dir;
+  uint32_t bucket_cnt;
+  bool success;
+
+  if (entry_cnt * sizeof (struct dir_entry) < DISK_SECTOR_SIZE)
+    return inode_create (sector, entry_cnt * sizeof (struct dir_entry));
+
+  /* Too big for one sector: start out hashed, with enough buckets
+     to be at most half full with ENTRY_CNT entries. */
+  if (!inode_create (sector, 0))
+    return false;
+  for (bucket_cnt = MIN_BUCKETS;
+       bucket_cnt < MAX_BUCKETS
+       && bucket_cnt * ENTRIES_PER_BUCKET < entry_cnt * 2; bucket_cnt *= 2)
+    continue;
+  dir = dir_open (inode_open (sector));
+  success = dir != NULL && rebuild (dir, bucket_cnt);
+  dir_close (dir);
+  return success;
 }
 
 /* Opens and returns the directory for the given INODE, of which
@@ -39,6 +116,7 @@ dir_open (struct inode *inode)
     {
       dir->inode = inode;
       dir->pos = 0;
+      inode_set_journaled (inode);
       return dir;
     }
   else
@@ -92,12 +170,20 @@ static bool
 lookup (const struct dir *dir, const char *name,
         struct dir_entry *ep, off_t *ofsp) 
 {
+  struct dir_header h;
   struct dir_entry e;
   size_t ofs;
   
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
+  if (read_header (dir, &h))
+    {
+      off_t free_ofs;
+
+      return probe (dir, &h, name, ep, ofsp, &free_ofs);
+    }
+
   for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
        ofs += sizeof e) 
     if (e.in_use && !strcmp (name, e.name)) 
@@ -114,20 +200,31 @@ lookup (const struct dir *dir, const char *name,
 /* Searches DIR for a file with the given NAME
    and returns true if one exists, false otherwise.
    On success, sets *INODE to an inode for the file, otherwise to
-   a null pointer.  The caller must close *INODE. */
+   a null pointer.  The caller must close *INODE.
+   Names looked up recently are answered from the dentry cache,
+   without reading DIR. */
 bool
 dir_lookup (const struct dir *dir, const char *name,
             struct inode **inode) 
 {
+  disk_sector_t dir_sector;
+  disk_sector_t sector;
   struct dir_entry e;
 
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
-  if (lookup (dir, name, &e, NULL))
-    *inode = inode_open (e.inode_sector);
-  else
-    *inode = NULL;
+  /* Hold the directory's lock until the file is open, so that it
+     cannot be removed and its inode freed in between. */
+  dir_sector = inode_get_inumber (dir->inode);
+  inode_lock (dir->inode);
+  if (!dcache_lookup (dir_sector, name, &sector))
+    {
+      sector = lookup (dir, name, &e, NULL) ? e.inode_sector : 0;
+      dcache_insert (dir_sector, name, sector);
+    }
+  *inode = sector != 0 ? inode_open (sector) : NULL;
+  inode_unlock (dir->inode);
 
   return *inode != NULL;
 }
@@ -152,6 +249,14 @@ dir_add (struct dir *dir, const char *name, disk_sector_t inode_sector)
   if (*name == '\0' || strlen (name) > NAME_MAX)
     return false;
 
+  journal_begin ();
+  inode_lock (dir->inode);
+  if (is_hashed (dir))
+    {
+      success = hashed_add (dir, name, inode_sector);
+      goto done;
+    }
+
   /* Check that NAME is not in use. */
   if (lookup (dir, name, NULL, NULL))
     goto done;
@@ -168,6 +273,15 @@ dir_add (struct dir *dir, const char *name, disk_sector_t inode_sector)
     if (!e.in_use)
       break;
 
+  /* If the directory has outgrown a sector, convert it to a hash
+     table and add NAME to that instead. */
+  if (ofs + sizeof e > DISK_SECTOR_SIZE)
+    {
+      success = rebuild (dir, MIN_BUCKETS)
+                && hashed_add (dir, name, inode_sector);
+      goto done;
+    }
+
   /* Write slot. */
   e.in_use = true;
   strlcpy (e.name, name, sizeof e.name);
@@ -175,6 +289,10 @@ dir_add (struct dir *dir, const char *name, disk_sector_t inode_sector)
   success = inode_write_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
 
  done:
+  if (success)
+    dcache_insert (inode_get_inumber (dir->inode), name, inode_sector);
+  inode_unlock (dir->inode);
+  journal_end ();
   return success;
 }
 
@@ -192,6 +310,9 @@ dir_remove (struct dir *dir, const char *name)
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
+  journal_begin ();
+  inode_lock (dir->inode);
+
   /* Find directory entry. */
   if (!lookup (dir, name, &e, &ofs))
     goto done;
@@ -205,13 +326,27 @@ dir_remove (struct dir *dir, const char *name)
   e.in_use = false;
   if (inode_write_at (dir->inode, &e, sizeof e, ofs) != sizeof e) 
     goto done;
+  {
+    struct dir_header h;
 
-  /* Remove inode. */
+    if (read_header (dir, &h))
+      {
+        h.entry_cnt--;
+        write_header (dir, &h);
+      }
+  }
+
+  /* Remove inode.  If it is a directory, its sector may be
+     reused for another one, so forget what was cached under it. */
   inode_remove (inode);
+  dcache_insert (inode_get_inumber (dir->inode), name, 0);
+  dcache_remove_dir (e.inode_sector);
   success = true;
 
  done:
   inode_close (inode);
+  inode_unlock (dir->inode);
+  journal_end ();
   return success;
 }
 
@@ -222,15 +357,313 @@ bool
 dir_readdir (struct dir *dir, char name[NAME_MAX + 1])
 {
   struct dir_entry e;
+  bool hashed, found = false;
 
-  while (inode_read_at (dir->inode, &e, sizeof e, dir->pos) == sizeof e) 
+  inode_lock (dir->inode);
+  hashed = is_hashed (dir);
+  while (!found && next_slot (dir, hashed, &dir->pos, &e))
     {
-      dir->pos += sizeof e;
       if (e.in_use)
         {
           strlcpy (name, e.name, NAME_MAX + 1);
-          return true;
+          found = true;
         } 
     }
+  inode_unlock (dir->inode);
+  return found;
+}
+
+/* Returns true if DIR is a hash table, false if it is a linear
+   array of entries. */
+static bool
+is_hashed (const struct dir *dir)
+{
+  struct dir_header h;
+  return read_header (dir, &h);
+}
+
+/* If DIR is a hash table, reads its header into *H and returns
+   true.  Otherwise, returns false. */
+static bool
+read_header (const struct dir *dir, struct dir_header *h)
+{
+  if (inode_length (dir->inode) < DISK_SECTOR_SIZE)
+    return false;
+  if (inode_read_at (dir->inode, h, sizeof *h, 0) != sizeof *h)
+    PANIC ("directory header read failed");
+  return h->magic == DIR_MAGIC;
+}
+
+/* Writes *H as hashed directory DIR's header.
+   Returns true if successful, false on failure. */
+static bool
+write_header (struct dir *dir, const struct dir_header *h)
+{
+  return inode_write_at (dir->inode, h, sizeof *h, 0) == sizeof *h;
+}
+
+/* Returns the byte offset of bucket B in a hashed directory. */
+static off_t
+bucket_ofs (uint32_t b)
+{
+  return (b + 1) * DISK_SECTOR_SIZE;
+}
+
+/* Searches hashed directory DIR, whose header is H, for NAME.
+   If successful, returns true and stores the entry and its byte
+   offset into *EP and *OFSP, if they are non-null.  Otherwise,
+   returns false and stores into *FREEP the offset of the first
+   free slot on NAME's probe sequence, or -1 if there is none. */
+static bool
+probe (const struct dir *dir, const struct dir_header *h, const char *name,
+       struct dir_entry *ep, off_t *ofsp, off_t *freep)
+{
+  struct dir_entry bucket[ENTRIES_PER_BUCKET];
+  uint32_t b = hash_string (name) % h->bucket_cnt;
+  uint32_t i;
+
+  *freep = -1;
+  for (i = 0; i < h->bucket_cnt; i++, b = (b + 1) % h->bucket_cnt)
+    {
+      off_t ofs = bucket_ofs (b);
+      off_t size = inode_read_at (dir->inode, bucket, sizeof bucket, ofs);
+      bool has_never_used = false;
+      size_t j;
+
+      /* Past end of file, buckets read as never used. */
+      memset ((uint8_t *) bucket + size, 0, sizeof bucket - size);
+      for (j = 0; j < ENTRIES_PER_BUCKET; j++)
+        {
+          struct dir_entry *e = &bucket[j];
+
+          if (e->in_use)
+            {
+              if (!strcmp (name, e->name))
+                {
+                  if (ep != NULL)
+                    *ep = *e;
+                  if (ofsp != NULL)
+                    *ofsp = ofs + j * sizeof *e;
+                  return true;
+                }
+            }
+          else
+            {
+              if (*freep == -1)
+                *freep = ofs + j * sizeof *e;
+              if (e->inode_sector == 0)
+                has_never_used = true;
+            }
+        }
+      if (has_never_used)
+        break;
+    }
   return false;
 }
+
+/* Adds a file named NAME, whose inode is in INODE_SECTOR, to
+   hashed directory DIR, growing the hash table if it is more
+   than 3/4 full.  Returns true if successful, false if NAME is
+   in use, the directory is full or a disk or memory error
+   occurs. */
+static bool
+hashed_add (struct dir *dir, const char *name, disk_sector_t inode_sector)
+{
+  struct dir_header h;
+  struct dir_entry e;
+  off_t ofs;
+
+  if (!read_header (dir, &h) || probe (dir, &h, name, NULL, NULL, &ofs))
+    return false;
+
+  /* Removed entries count toward the load, because they lengthen
+     probe sequences, so a table full of them is rebuilt at the
+     same size to get rid of them.  A table with MAX_BUCKETS
+     buckets just keeps filling up, unless a quarter of it is
+     removed entries. */
+  if ((h.used_cnt + 1) * 4 > h.bucket_cnt * ENTRIES_PER_BUCKET * 3
+      && (h.bucket_cnt < MAX_BUCKETS
+          || (h.used_cnt - h.entry_cnt) * 4
+             >= h.bucket_cnt * ENTRIES_PER_BUCKET))
+    {
+      uint32_t bucket_cnt = h.bucket_cnt;
+
+      while (bucket_cnt < MAX_BUCKETS
+             && (h.entry_cnt + 1) * 2 > bucket_cnt * ENTRIES_PER_BUCKET)
+        bucket_cnt *= 2;
+      if (!rebuild (dir, bucket_cnt))
+        return false;
+      read_header (dir, &h);
+      probe (dir, &h, name, NULL, NULL, &ofs);
+    }
+  if (ofs == -1)
+    return false;
+
+  /* Reusing a removed entry's slot doesn't change the load. */
+  if (inode_read_at (dir->inode, &e, sizeof e, ofs) != sizeof e
+      || e.inode_sector == 0)
+    h.used_cnt++;
+  h.entry_cnt++;
+
+  e.in_use = true;
+  strlcpy (e.name, name, sizeof e.name);
+  e.inode_sector = inode_sector;
+  return (inode_write_at (dir->inode, &e, sizeof e, ofs) == sizeof e
+          && write_header (dir, &h));
+}
+
+/* A sector of zeros. */
+static const uint8_t zeros[DISK_SECTOR_SIZE];
+
+/* Writes the sector of data in BUFFER to DIR at byte offset OFS.
+   Returns true if successful, false if the disk is full. */
+static bool
+write_sector (struct dir *dir, const void *buffer, off_t ofs)
+{
+  return inode_write_at (dir->inode, buffer, DISK_SECTOR_SIZE, ofs)
+         == DISK_SECTOR_SIZE;
+}
+
+/* Returns true if the SIZE bytes at BUFFER are all zeros. */
+static bool
+is_zeros (const uint8_t *buffer, size_t size)
+{
+  size_t i;
+
+  for (i = 0; i < size; i++)
+    if (buffer[i] != 0)
+      return false;
+  return true;
+}
+
+/* Returns true if rebuild() has to write sector OFS of the NEW
+   table over the OLD one, which is OLD_SIZE bytes long.  A sector
+   that is all zeros in both is skipped, so that an empty bucket
+   that is a hole stays one. */
+static bool
+must_write (const uint8_t *old, off_t old_size, const uint8_t *new,
+            off_t ofs)
+{
+  bool old_zeros = ofs >= old_size || is_zeros (old + ofs, DISK_SECTOR_SIZE);
+  return !(old_zeros && is_zeros (new + ofs, DISK_SECTOR_SIZE));
+}
+
+/* Rewrites DIR, in either layout, as a hash table with
+   BUCKET_CNT buckets that holds the entries currently in use.
+   Returns true if successful, false if out of memory or disk
+   space, in which case DIR is left as it was.
+
+   The new table is built in memory and written over the old one
+   a sector at a time, skipping buckets that are empty in both,
+   so that they can stay holes, and the header last.  If a write
+   fails because the disk is full, the sectors already written
+   are put back as they were.  Those sectors have been allocated
+   by then, so putting them back cannot fail. */
+static bool
+rebuild (struct dir *dir, uint32_t bucket_cnt)
+{
+  struct dir_header old_h, *h;
+  uint8_t *old = NULL, *new = NULL;
+  off_t old_size, new_size = (bucket_cnt + 1) * DISK_SECTOR_SIZE;
+  off_t ofs, read;
+  bool hashed = read_header (dir, &old_h);
+  bool success = false;
+  size_t i;
+
+  /* Read the old table whole. */
+  old_size = hashed ? (old_h.bucket_cnt + 1) * DISK_SECTOR_SIZE
+                    : DISK_SECTOR_SIZE;
+  old = malloc (old_size);
+  new = calloc (1, new_size);
+  if (old == NULL || new == NULL)
+    goto done;
+  read = inode_read_at (dir->inode, old, old_size, 0);
+  memset (old + read, 0, old_size - read);
+
+  /* Put each entry in use into the first never-used slot on its
+     probe sequence in the new table, which has no removed
+     entries to skip. */
+  h = (struct dir_header *) new;
+  h->magic = DIR_MAGIC;
+  h->bucket_cnt = bucket_cnt;
+  for (ofs = hashed ? DISK_SECTOR_SIZE : 0;
+       ofs + (off_t) sizeof (struct dir_entry) <= old_size;
+       ofs += sizeof (struct dir_entry))
+    {
+      const struct dir_entry *e = (const struct dir_entry *) (old + ofs);
+      uint32_t b;
+
+      /* Skip the unused tail of each bucket, and in a linear
+         directory, anything past the first sector's slots. */
+      if (ofs % DISK_SECTOR_SIZE + sizeof *e > DISK_SECTOR_SIZE)
+        {
+          ofs = ROUND_UP (ofs, DISK_SECTOR_SIZE) - sizeof *e;
+          continue;
+        }
+      if (!e->in_use)
+        continue;
+
+      for (b = hash_string (e->name) % bucket_cnt; ;
+           b = (b + 1) % bucket_cnt)
+        {
+          struct dir_entry *bucket
+            = (struct dir_entry *) (new + bucket_ofs (b));
+
+          for (i = 0; i < ENTRIES_PER_BUCKET; i++)
+            if (bucket[i].inode_sector == 0)
+              break;
+          if (i < ENTRIES_PER_BUCKET)
+            {
+              bucket[i] = *e;
+              break;
+            }
+        }
+      h->entry_cnt++;
+    }
+  h->used_cnt = h->entry_cnt;
+
+  /* Write the buckets, then the header, which puts the new
+     table in effect. */
+  for (ofs = DISK_SECTOR_SIZE; ofs < new_size; ofs += DISK_SECTOR_SIZE)
+    if (must_write (old, old_size, new, ofs)
+        && !write_sector (dir, new + ofs, ofs))
+      break;
+  if (ofs < new_size || !write_sector (dir, new, 0))
+    {
+      off_t end = ofs;
+
+      for (ofs = DISK_SECTOR_SIZE; ofs < end; ofs += DISK_SECTOR_SIZE)
+        if (must_write (old, old_size, new, ofs))
+          write_sector (dir, ofs < old_size ? old + ofs : zeros, ofs);
+      dcache_remove_dir (inode_get_inumber (dir->inode));
+      goto done;
+    }
+  success = true;
+
+ done:
+  free (old);
+  free (new);
+  return success;
+}
+
+/* Reads the directory slot at byte offset *POS in DIR, whether
+   in use or not, into *E and advances *POS to the next slot,
+   skipping over the header and the unused tail of each bucket in
+   a hashed directory.  Returns true if successful, false at end
+   of directory. */
+static bool
+next_slot (struct dir *dir, bool hashed, off_t *pos, struct dir_entry *e)
+{
+  if (hashed)
+    {
+      if (*pos < DISK_SECTOR_SIZE)
+        *pos = DISK_SECTOR_SIZE;
+      else if ((size_t) (*pos % DISK_SECTOR_SIZE) / sizeof *e
+               >= ENTRIES_PER_BUCKET)
+        *pos = ROUND_UP (*pos, DISK_SECTOR_SIZE);
+    }
+  if (inode_read_at (dir->inode, e, sizeof *e, *pos) != sizeof *e)
+    return false;
+  *pos += sizeof *e;
+  return true;
+}
@@ -1,7 +1,10 @@
 #include "filesys/file.h"
 #include <debug.h>
+#include <round.h>
 #include "filesys/inode.h"
 #include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/vaddr.h"
 
 /* An open file. */
 struct file 
@@ -9,8 +12,12 @@ struct file
     struct inode *inode;        /* File's inode. */
     off_t pos;                  /* Current position. */
     bool deny_write;            /* Has file_deny_write() been called? */
+    off_t next_read;            /* Where a sequential read would start. */
   };
 
+static off_t read_at (struct file *, void *, off_t size, off_t file_ofs);
+static bool iov_fits (const struct iovec *, int cnt);
+
 /* Opens a file for the given INODE, of which it takes ownership,
    and returns the new file.  Returns a null pointer if an
    allocation fails or if INODE is null. */
@@ -23,6 +30,7 @@ file_open (struct inode *inode)
       file->inode = inode;
       file->pos = 0;
       file->deny_write = false;
+      file->next_read = 0;
       return file;
     }
   else
@@ -68,7 +76,7 @@ file_get_inode (struct file *file)
 off_t
 file_read (struct file *file, void *buffer, off_t size) 
 {
-  off_t bytes_read = inode_read_at (file->inode, buffer, size, file->pos);
+  off_t bytes_read = read_at (file, buffer, size, file->pos);
   file->pos += bytes_read;
   return bytes_read;
 }
@@ -81,7 +89,26 @@ file_read (struct file *file, void *buffer, off_t size)
 off_t
 file_read_at (struct file *file, void *buffer, off_t size, off_t file_ofs) 
 {
-  return inode_read_at (file->inode, buffer, size, file_ofs);
+  return read_at (file, buffer, size, file_ofs);
+}
+
+/* Reads SIZE bytes from FILE into BUFFER, starting at offset
+   FILE_OFS, and returns the number of bytes read.
+   If this read continues where the previous read from FILE
+   ended, FILE is probably being read sequentially, so the next
+   few sectors past this read are fetched into the buffer cache
+   in the background. */
+static off_t
+read_at (struct file *file, void *buffer, off_t size, off_t file_ofs) 
+{
+  bool sequential = file_ofs == file->next_read;
+  off_t bytes_read = inode_read_at (file->inode, buffer, size, file_ofs);
+
+  file->next_read = file_ofs + bytes_read;
+  if (sequential && bytes_read > 0)
+    inode_readahead (file->inode,
+                     ROUND_UP (file->next_read, DISK_SECTOR_SIZE));
+  return bytes_read;
 }
 
 /* Writes SIZE bytes from BUFFER into FILE,
@@ -113,6 +140,118 @@ file_write_at (struct file *file, const void *buffer, off_t size,
   return inode_write_at (file->inode, buffer, size, file_ofs);
 }
 
+/* Reads from FILE, starting at the file's current position, into
+   each of the CNT buffers in IOV in turn, as file_read() would,
+   stopping after the first short read.
+   Returns the total number of bytes read, or -1, without reading
+   anything, if the buffers' total length does not fit in an
+   off_t.
+   Advances FILE's position by the number of bytes read. */
+off_t
+file_readv (struct file *file, const struct iovec *iov, int cnt)
+{
+  off_t total = 0;
+  int i;
+
+  if (!iov_fits (iov, cnt))
+    return -1;
+  for (i = 0; i < cnt; i++)
+    {
+      off_t bytes_read = file_read (file, iov[i].iov_base, iov[i].iov_len);
+      total += bytes_read;
+      if (bytes_read < (off_t) iov[i].iov_len)
+        break;
+    }
+  return total;
+}
+
+/* Writes each of the CNT buffers in IOV in turn into FILE,
+   starting at the file's current position, as file_write()
+   would, stopping after the first short write.
+   Returns the total number of bytes written, or -1, without
+   writing anything, if the buffers' total length does not fit in
+   an off_t.
+   Advances FILE's position by the number of bytes written. */
+off_t
+file_writev (struct file *file, const struct iovec *iov, int cnt)
+{
+  off_t total = 0;
+  int i;
+
+  if (!iov_fits (iov, cnt))
+    return -1;
+  for (i = 0; i < cnt; i++)
+    {
+      off_t bytes_written = file_write (file, iov[i].iov_base,
+                                        iov[i].iov_len);
+      total += bytes_written;
+      if (bytes_written < (off_t) iov[i].iov_len)
+        break;
+    }
+  return total;
+}
+
+/* Returns true if the total length of the CNT buffers in IOV
+   fits in an off_t, which is an int32_t. */
+static bool
+iov_fits (const struct iovec *iov, int cnt)
+{
+  size_t total = 0;
+  int i;
+
+  for (i = 0; i < cnt; i++)
+    {
+      if (iov[i].iov_len > (size_t) INT32_MAX - total)
+        return false;
+      total += iov[i].iov_len;
+    }
+  return true;
+}
+
+/* Copies up to SIZE bytes from IN, starting at its current
+   position, into OUT, starting at its current position, entirely
+   within the kernel, in the argument order of the
+   copy_file_range system call.  The data is copied a page at a
+   time out of IN's sectors in the buffer cache into a page of
+   kernel memory, and from there into OUT's sectors, so it never
+   passes through user memory.
+   Returns the number of bytes copied, which is less than SIZE if
+   IN ends first, OUT cannot be written or no page is free.
+   Advances both files' positions by the number of bytes
+   copied. */
+off_t
+file_copy (struct file *in, struct file *out, off_t size)
+{
+  uint8_t *buffer;
+  off_t total = 0;
+
+  buffer = palloc_get_page (0);
+  if (buffer == NULL)
+    return 0;
+  while (size > 0)
+    {
+      off_t chunk = PGSIZE - in->pos % PGSIZE;
+      off_t bytes_read, bytes_written;
+
+      if (chunk > size)
+        chunk = size;
+      bytes_read = file_read (in, buffer, chunk);
+      if (bytes_read == 0)
+        break;
+      bytes_written = file_write (out, buffer, bytes_read);
+      total += bytes_written;
+      size -= bytes_written;
+      if (bytes_written < bytes_read)
+        {
+          /* Leave IN just past what was copied. */
+          in->pos -= bytes_read - bytes_written;
+          break;
+        }
+    }
+  palloc_free_page (buffer);
+  return total;
+}
+
 /* Prevents write operations on FILE's underlying inode
    until file_allow_write() is called or FILE is closed. */
 void
@@ -1,6 +1,7 @@
 #ifndef FILESYS_FILE_H
 #define FILESYS_FILE_H
 
+#include <iovec.h>
 #include "filesys/off_t.h"
 
 struct inode;
@@ -16,6 +17,9 @@ off_t file_read (struct file *, void *, off_t);
 off_t file_read_at (struct file *, void *, off_t size, off_t start);
 off_t file_write (struct file *, const void *, off_t);
 off_t file_write_at (struct file *, const void *, off_t size, off_t start);
+off_t file_readv (struct file *, const struct iovec *, int cnt);
+off_t file_writev (struct file *, const struct iovec *, int cnt);
+off_t file_copy (struct file *in, struct file *out, off_t size);
 
 /* Preventing writes. */
 void file_deny_write (struct file *);
@@ -1,22 +1,114 @@
 #include "filesys/free-map.h"
 #include <bitmap.h>
 #include <debug.h>
+#include <round.h>
+#include <stdint.h>
+#include "filesys/cache.h"
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
+#include "threads/synch.h"
 
 static struct file *free_map_file;   /* Free map file. */
+
+/* True while free_map_create() writes the new free map file, the
+   only time that sectors may be allocated without it open. */
+static bool creating;
 static struct bitmap *free_map;      /* Free map, one bit per disk sector. */
 
+/* Identifies the superblock. */
+#define SUPER_MAGIC 0x53555042
+
+/* Superblock, in sector SUPER_SECTOR.
+   Must be exactly DISK_SECTOR_SIZE bytes long.
+
+   While the file system is mounted, CLEAN is false.  It is set
+   to true at shutdown, in the same transaction that records how
+   many sectors are free, so that the next mount can take
+   FREE_CNT as is instead of counting the whole free map. */
+struct superblock
+  {
+    unsigned magic;                     /* SUPER_MAGIC. */
+    uint32_t sector_cnt;                /* Sectors in the file system. */
+    uint32_t free_cnt;                  /* Free sectors, if CLEAN. */
+    uint32_t clean;                     /* Unmounted cleanly? */
+    uint32_t unused[124];               /* Not used. */
+  };
+static struct superblock super;
+
+/* The free map file is read in chunks of CHUNK_BITS bits, one
+   sector's worth, each the first time it is needed, so mounting
+   reads none of it and allocation reads only as much as it must
+   to find free sectors.  LOADED has a bit for each chunk that
+   has been read.  The bits of chunks not read yet are all set in
+   FREE_MAP, so that allocation does not look at them. */
+#define CHUNK_BITS (DISK_SECTOR_SIZE * 8)
+static struct bitmap *loaded;
+
+/* Protects FREE_MAP, LOADED, NEXT_FIT and the free map file's
+   contents.  Allocation takes only this lock, not any lock on
+   the file system as a whole. */
+static struct lock free_map_lock;
+
+/* The disk is divided into groups of GROUP_SECTORS sectors.  A
+   new file's inode goes in its directory's group, and its data
+   follows the inode, so a directory's small files and their
+   inodes end up close together. */
+#define GROUP_SECTORS 1024
+
+/* Where the next search for free sectors starts: just past the
+   last sectors allocated (next fit), so that allocations don't
+   keep rescanning the full start of the disk. */
+static disk_sector_t next_fit;
+
+/* Number of free sectors, and how many of them are reserved by
+   free_map_reserve() for allocations that have been put off.
+   Ordinary allocations may only use the FREE_CNT - RESERVED_CNT
+   sectors that are not reserved. */
+static size_t free_cnt, reserved_cnt;
+
+/* Sectors freed by free_map_release_metadata() since the last
+   commit, and how many there are.  They are written to the free
+   map file as free, so that the free map committed along with
+   their release is right, but are kept marked in use in
+   FREE_MAP until that commit.  Otherwise they could be reused,
+   and overwritten, while a crash would still bring back the
+   metadata they held. */
+static struct bitmap *held;
+static size_t held_cnt;
+
+static size_t available (const size_t *reserved);
+static void take (size_t cnt, size_t *reserved);
+static void load_range (disk_sector_t, size_t);
+static void load_chunk (size_t);
+static disk_sector_t scan_and_flip (disk_sector_t start, size_t cnt);
+static disk_sector_t scan_range (size_t start, size_t end, size_t cnt);
+static bool write_range (disk_sector_t, size_t);
+static void set_held (size_t start, size_t end, bool value);
+static void write_super (bool clean);
+
 /* Initializes the free map. */
 void
 free_map_init (void) 
 {
-  free_map = bitmap_create (disk_size (filesys_disk));
-  if (free_map == NULL)
+  size_t sector_cnt = disk_size (filesys_disk);
+
+  ASSERT (sizeof super == DISK_SECTOR_SIZE);
+
+  free_map = bitmap_create (sector_cnt);
+  loaded = bitmap_create (DIV_ROUND_UP (sector_cnt, CHUNK_BITS));
+  held = bitmap_create (sector_cnt);
+  if (free_map == NULL || loaded == NULL || held == NULL)
     PANIC ("bitmap creation failed--disk is too large");
+  bitmap_set_all (loaded, true);
   bitmap_mark (free_map, FREE_MAP_SECTOR);
   bitmap_mark (free_map, ROOT_DIR_SECTOR);
+  bitmap_set_multiple (free_map, JOURNAL_START, JOURNAL_SECTORS, true);
+  bitmap_mark (free_map, SUPER_SECTOR);
+  free_cnt = bitmap_count (free_map, 0, bitmap_size (free_map), false);
+  reserved_cnt = 0;
+  lock_init (&free_map_lock);
 }
 
 /* Allocates CNT consecutive sectors from the free map and stores
@@ -26,44 +118,234 @@ free_map_init (void)
 bool
 free_map_allocate (size_t cnt, disk_sector_t *sectorp) 
 {
-  disk_sector_t sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
-  if (sector != BITMAP_ERROR
-      && free_map_file != NULL
-      && !bitmap_write (free_map, free_map_file))
+  return free_map_allocate_near (cnt, next_fit, sectorp, NULL);
+}
+
+/* Allocates CNT consecutive sectors from the free map, as close
+   after sector HINT as possible, and stores the first into
+   *SECTORP.  If RESERVED is non-null, the *RESERVED sectors that
+   the caller has reserved with free_map_reserve() may be used,
+   and those used are taken off *RESERVED.
+   Returns true if successful, false if not enough consecutive
+   sectors were available. */
+bool
+free_map_allocate_near (size_t cnt, disk_sector_t hint,
+                        disk_sector_t *sectorp, size_t *reserved)
+{
+  disk_sector_t sector;
+
+  lock_acquire (&free_map_lock);
+  sector = BITMAP_ERROR;
+  if (cnt <= available (reserved))
+    sector = scan_and_flip (hint, cnt);
+  if (sector != BITMAP_ERROR && !write_range (sector, cnt))
     {
       bitmap_set_multiple (free_map, sector, cnt, false); 
       sector = BITMAP_ERROR;
     }
   if (sector != BITMAP_ERROR)
-    *sectorp = sector;
+    {
+      *sectorp = sector;
+      next_fit = sector + cnt;
+      take (cnt, reserved);
+    }
+  lock_release (&free_map_lock);
   return sector != BITMAP_ERROR;
 }
 
+/* Allocates a sector for a new file's inode in the same group as
+   DIR, the inode of its directory, if there is room there, and
+   stores it into *SECTORP.
+   Returns true if successful, false if the disk is full. */
+bool
+free_map_allocate_inode (struct inode *dir, disk_sector_t *sectorp)
+{
+  disk_sector_t dir_sector = inode_get_inumber (dir);
+  return free_map_allocate_near (1, dir_sector - dir_sector % GROUP_SECTORS,
+                                 sectorp, NULL);
+}
+
+/* Allocates the free sectors starting at SECTOR, up to CNT of
+   them, stopping at the first one in use.  RESERVED is as for
+   free_map_allocate_near().  Returns the number of sectors
+   allocated, which is 0 if SECTOR itself is in use. */
+size_t
+free_map_allocate_at (disk_sector_t sector, size_t cnt, size_t *reserved)
+{
+  size_t n = 0;
+
+  lock_acquire (&free_map_lock);
+  if (cnt > available (reserved))
+    cnt = available (reserved);
+  if (sector < bitmap_size (free_map))
+    load_range (sector, cnt);
+  while (n < cnt && sector + n < bitmap_size (free_map)
+         && !bitmap_test (free_map, sector + n))
+    n++;
+  if (n > 0)
+    {
+      bitmap_set_multiple (free_map, sector, n, true);
+      if (!write_range (sector, n))
+        {
+          bitmap_set_multiple (free_map, sector, n, false);
+          n = 0;
+        }
+      take (n, reserved);
+    }
+  lock_release (&free_map_lock);
+  return n;
+}
+
 /* Makes CNT sectors starting at SECTOR available for use. */
 void
 free_map_release (disk_sector_t sector, size_t cnt)
 {
+  lock_acquire (&free_map_lock);
+  load_range (sector, cnt);
   ASSERT (bitmap_all (free_map, sector, cnt));
   bitmap_set_multiple (free_map, sector, cnt, false);
-  bitmap_write (free_map, free_map_file);
+  free_cnt += cnt;
+  journal_forget (sector, cnt);
+  write_range (sector, cnt);
+  lock_release (&free_map_lock);
+}
+
+/* Frees CNT sectors starting at SECTOR, as free_map_release()
+   does, but holds them back from reuse until the running
+   transaction commits.  Used for sectors that held metadata. */
+void
+free_map_release_metadata (disk_sector_t sector, size_t cnt)
+{
+  lock_acquire (&free_map_lock);
+  load_range (sector, cnt);
+  ASSERT (bitmap_all (free_map, sector, cnt));
+  ASSERT (bitmap_none (held, sector, cnt));
+  bitmap_set_multiple (held, sector, cnt, true);
+  held_cnt += cnt;
+  journal_forget (sector, cnt);
+  write_range (sector, cnt);
+  lock_release (&free_map_lock);
+}
+
+/* Makes the sectors held back by free_map_release_metadata()
+   available, now that the transaction that freed them has been
+   committed.  Called by the journal. */
+void
+free_map_commit (void)
+{
+  size_t sector = 0;
+
+  lock_acquire (&free_map_lock);
+  free_cnt += held_cnt;
+  for (; held_cnt > 0; held_cnt--)
+    {
+      sector = bitmap_scan_and_flip (held, sector, 1, true);
+      bitmap_reset (free_map, sector);
+    }
+  lock_release (&free_map_lock);
+}
+
+/* Sets aside CNT free sectors for an allocation that is to be
+   made later, so that other allocations cannot use them up in
+   the meantime.  The real allocation draws on the reservation by
+   passing it to free_map_allocate_near() or
+   free_map_allocate_at(), and whatever is left of it is given
+   back with free_map_unreserve().
+   Returns true if successful, false if fewer than CNT free
+   sectors are left unreserved. */
+bool
+free_map_reserve (size_t cnt)
+{
+  bool success;
+
+  lock_acquire (&free_map_lock);
+  success = cnt <= free_cnt - reserved_cnt;
+  if (success)
+    reserved_cnt += cnt;
+  lock_release (&free_map_lock);
+  return success;
+}
+
+/* Gives back CNT sectors reserved with free_map_reserve(). */
+void
+free_map_unreserve (size_t cnt)
+{
+  lock_acquire (&free_map_lock);
+  ASSERT (reserved_cnt >= cnt);
+  reserved_cnt -= cnt;
+  lock_release (&free_map_lock);
+}
+
+/* Returns the number of free sectors that an allocation may use:
+   those not reserved, plus the *RESERVED sectors reserved by the
+   caller if RESERVED is non-null.  FREE_MAP_LOCK must be held. */
+static size_t
+available (const size_t *reserved)
+{
+  return free_cnt - reserved_cnt + (reserved != NULL ? *reserved : 0);
+}
+
+/* Counts CNT sectors as allocated, taking as many of them as
+   possible out of the caller's *RESERVED sectors if RESERVED is
+   non-null.  FREE_MAP_LOCK must be held. */
+static void
+take (size_t cnt, size_t *reserved)
+{
+  free_cnt -= cnt;
+  if (reserved != NULL)
+    {
+      size_t n = cnt < *reserved ? cnt : *reserved;
+      *reserved -= n;
+      reserved_cnt -= n;
+    }
 }
 
-/* Opens the free map file and reads it from disk. */
+/* Opens the free map file and reads the superblock.  If the file
+   system was unmounted cleanly, the free map is read later, a
+   chunk at a time, as allocation needs it.  Otherwise, it is
+   read in full now, to count the free sectors. */
 void
 free_map_open (void) 
 {
+  cache_read (SUPER_SECTOR, &super, 0, DISK_SECTOR_SIZE);
+  if (super.magic != SUPER_MAGIC)
+    PANIC ("no file system superblock--reformat with -f");
+  if (super.sector_cnt != bitmap_size (free_map))
+    PANIC ("file system size does not match disk size");
+
   free_map_file = file_open (inode_open (FREE_MAP_SECTOR));
   if (free_map_file == NULL)
     PANIC ("can't open free map");
-  if (!bitmap_read (free_map, free_map_file))
-    PANIC ("can't read free map");
+  inode_set_journaled (file_get_inode (free_map_file));
+
+  bitmap_set_all (free_map, true);
+  bitmap_set_all (loaded, false);
+  if (super.clean)
+    free_cnt = super.free_cnt;
+  else
+    {
+      if (!bitmap_read (free_map, free_map_file))
+        PANIC ("can't read free map");
+      bitmap_set_all (loaded, true);
+      free_cnt = bitmap_count (free_map, 0, bitmap_size (free_map), false);
+    }
+
+  /* Anything from here on may leave FREE_CNT out of date. */
+  journal_begin ();
+  write_super (false);
+  journal_end ();
 }
 
-/* Writes the free map to disk and closes the free map file. */
+/* Records the number of free sectors in the superblock, marks
+   the file system clean, and closes the free map file. */
 void
 free_map_close (void) 
 {
+  journal_begin ();
+  write_super (true);
+  journal_end ();
   file_close (free_map_file);
+  free_map_file = NULL;
 }
 
 /* Creates a new free map file on disk and writes the free map to
@@ -71,14 +353,186 @@ free_map_close (void)
 void
 free_map_create (void) 
 {
+  struct file *file;
+
   /* Create inode. */
   if (!inode_create (FREE_MAP_SECTOR, bitmap_file_size (free_map)))
     PANIC ("free map creation failed");
 
-  /* Write bitmap to file. */
-  free_map_file = file_open (inode_open (FREE_MAP_SECTOR));
-  if (free_map_file == NULL)
+  /* Write bitmap to file.  The file is created as a hole, so
+     this write allocates its sectors; leave free_map_file null
+     until it is done, so that those allocations do not try to
+     write the free map again. */
+  creating = true;
+  file = file_open (inode_open (FREE_MAP_SECTOR));
+  if (file == NULL)
     PANIC ("can't open free map");
-  if (!bitmap_write (free_map, free_map_file))
+  inode_set_journaled (file_get_inode (file));
+  if (!bitmap_write (free_map, file))
     PANIC ("can't write free map");
+  free_map_file = file;
+  creating = false;
+
+  super.magic = SUPER_MAGIC;
+  super.sector_cnt = bitmap_size (free_map);
+  write_super (false);
+}
+
+/* Makes sure that the chunks of the free map that cover the CNT
+   sectors starting at SECTOR, as far as the end of the disk, have
+   been read.  FREE_MAP_LOCK must be held. */
+static void
+load_range (disk_sector_t sector, size_t cnt)
+{
+  size_t end = bitmap_size (free_map);
+  size_t chunk;
+
+  if (cnt == 0 || sector >= end)
+    return;
+  if (cnt > end - sector)
+    cnt = end - sector;
+  for (chunk = sector / CHUNK_BITS; chunk <= (sector + cnt - 1) / CHUNK_BITS;
+       chunk++)
+    if (!bitmap_test (loaded, chunk))
+      load_chunk (chunk);
+}
+
+/* Reads chunk CHUNK of the free map from the free map file.
+   FREE_MAP_LOCK must be held. */
+static void
+load_chunk (size_t chunk)
+{
+  size_t start = chunk * CHUNK_BITS;
+  size_t cnt = bitmap_size (free_map) - start;
+
+  if (cnt > CHUNK_BITS)
+    cnt = CHUNK_BITS;
+  if (!bitmap_read_range (free_map, free_map_file, start, cnt))
+    PANIC ("can't read free map");
+  bitmap_mark (loaded, chunk);
+}
+
+/* Finds CNT consecutive free sectors at or after START, or
+   failing that anywhere on the disk, marks them in use, and
+   returns the first.  Returns BITMAP_ERROR if there are none.
+
+   Only the chunks of the free map read so far are searched at
+   first, starting with START's.  Each time that fails, the next
+   chunk not read yet is read, and only the runs that it could
+   have completed are searched: those within the chunk or
+   crossing one of its edges. */
+static disk_sector_t
+scan_and_flip (disk_sector_t start, size_t cnt)
+{
+  size_t first_chunk = 0;
+  disk_sector_t sector = BITMAP_ERROR;
+
+  if (start < bitmap_size (free_map))
+    {
+      load_range (start, cnt);
+      first_chunk = start / CHUNK_BITS;
+      sector = bitmap_scan_and_flip (free_map, start, cnt, false);
+    }
+  if (sector == BITMAP_ERROR && start != 0)
+    sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
+
+  while (sector == BITMAP_ERROR)
+    {
+      size_t chunk, lo, hi;
+
+      chunk = bitmap_scan (loaded, first_chunk, 1, false);
+      if (chunk == BITMAP_ERROR)
+        chunk = bitmap_scan (loaded, 0, 1, false);
+      if (chunk == BITMAP_ERROR)
+        return BITMAP_ERROR;
+      load_chunk (chunk);
+
+      /* CNT is not 0 here: that always succeeds above. */
+      lo = chunk * CHUNK_BITS;
+      lo = lo > cnt - 1 ? lo - (cnt - 1) : 0;
+      hi = (chunk + 1) * CHUNK_BITS + (cnt - 1);
+      sector = scan_range (lo, hi, cnt);
+    }
+  return sector;
+}
+
+/* Finds CNT consecutive free sectors that lie entirely within
+   sectors START up to END, marks them in use, and returns the
+   first.  Returns BITMAP_ERROR if there are none.  END may be
+   past the end of the disk. */
+static disk_sector_t
+scan_range (size_t start, size_t end, size_t cnt)
+{
+  size_t i;
+
+  if (end > bitmap_size (free_map))
+    end = bitmap_size (free_map);
+  for (i = start; i + cnt <= end; i++)
+    if (bitmap_none (free_map, i, cnt))
+      {
+        bitmap_set_multiple (free_map, i, cnt, true);
+        return i;
+      }
+  return BITMAP_ERROR;
+}
+
+/* Writes the part of the free map that covers the CNT sectors
+   starting at SECTOR to the free map file, if it is open.  Only
+   the bitmap words that changed are written, and they only go
+   as far as the buffer cache, so an allocation normally costs no
+   disk I/O of its own.  Held sectors in those words are written
+   as free.  Returns true if successful.
+
+   While free_map_create() writes the free map file, there is
+   nothing to write to, and the file's own write brings it up to
+   date.  At any other time the file must be open: an allocation
+   after free_map_close() would never reach the disk. */
+static bool
+write_range (disk_sector_t sector, size_t cnt)
+{
+  size_t start, end;
+  bool success;
+
+  if (free_map_file == NULL)
+    {
+      ASSERT (creating);
+      return true;
+    }
+  if (held_cnt == 0)
+    return bitmap_write_range (free_map, free_map_file, sector, cnt);
+
+  /* Clear the held sectors' bits in the chunks being written
+     while writing them. */
+  start = ROUND_DOWN (sector, CHUNK_BITS);
+  end = ROUND_UP (sector + cnt, CHUNK_BITS);
+  if (end > bitmap_size (free_map))
+    end = bitmap_size (free_map);
+  set_held (start, end, false);
+  success = bitmap_write_range (free_map, free_map_file, sector, cnt);
+  set_held (start, end, true);
+  return success;
+}
+
+/* Sets the bits in FREE_MAP of the held sectors from START up to
+   END to VALUE. */
+static void
+set_held (size_t start, size_t end, bool value)
+{
+  size_t sector;
+
+  for (sector = start; sector < end; sector++)
+    if (bitmap_test (held, sector))
+      bitmap_set (free_map, sector, value);
+}
+
+/* Writes the superblock, with the current free sector count and
+   CLEAN as its clean flag, through the journal.  Held sectors
+   count as free, because they are by the time the superblock is
+   committed. */
+static void
+write_super (bool clean)
+{
+  super.free_cnt = free_cnt + held_cnt;
+  super.clean = clean;
+  journal_write (SUPER_SECTOR, &super, 0, DISK_SECTOR_SIZE);
 }
@@ -4,6 +4,12 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include "devices/disk.h"
+#include "filesys/journal.h"
+
+/* Superblock sector, right after the journal. */
+#define SUPER_SECTOR (JOURNAL_START + JOURNAL_SECTORS)
+
+struct inode;
 
 void free_map_init (void);
 void free_map_read (void);
@@ -12,6 +18,14 @@ void free_map_open (void);
 void free_map_close (void);
 
 bool free_map_allocate (size_t, disk_sector_t *);
+bool free_map_allocate_near (size_t, disk_sector_t hint, disk_sector_t *,
+                             size_t *reserved);
+bool free_map_allocate_inode (struct inode *dir, disk_sector_t *);
+size_t free_map_allocate_at (disk_sector_t, size_t, size_t *reserved);
 void free_map_release (disk_sector_t, size_t);
+void free_map_release_metadata (disk_sector_t, size_t);
+void free_map_commit (void);
+bool free_map_reserve (size_t);
+void free_map_unreserve (size_t);
 
 #endif /* filesys/free-map.h */
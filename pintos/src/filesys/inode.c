@@ -1,25 +1,132 @@
 #include "filesys/inode.h"
+#include <hash.h>
 #include <list.h>
 #include <debug.h>
 #include <round.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <string.h>
+#include "filesys/cache.h"
 #include "filesys/filesys.h"
 #include "filesys/free-map.h"
+#include "filesys/journal.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
 
 /* Identifies an inode. */
 #define INODE_MAGIC 0x494e4f44
 
+/* A run of LENGTH consecutive data sectors, starting at disk
+   sector START, that holds the file's sectors OFFSET through
+   OFFSET + LENGTH - 1. */
+struct extent
+  {
+    uint32_t offset;                    /* First file sector. */
+    disk_sector_t start;                /* First disk sector. */
+    uint32_t length;                    /* Number of sectors. */
+  };
+
+/* Number of extents stored in the inode itself and in each
+   overflow extent block. */
+#define INODE_EXTENT_CNT 41
+#define BLOCK_EXTENT_CNT 42
+
+/* Most bytes of file data that can be stored inline, in the
+   inode itself, in place of its extents. */
+#define INLINE_MAX (INODE_EXTENT_CNT * sizeof (struct extent))
+
+/* Number of direct, indirect and doubly indirect sector pointers
+   in an indexed inode, and the number of data sectors they can
+   address, a little over 8 MB. */
+#define DIRECT_CNT 121
+#define PTRS_PER_SECTOR ((size_t) (DISK_SECTOR_SIZE / sizeof (disk_sector_t)))
+#define INDIRECT_CNT PTRS_PER_SECTOR
+#define DBL_INDIRECT_CNT (PTRS_PER_SECTOR * PTRS_PER_SECTOR)
+#define INDEXED_SECTOR_CNT (DIRECT_CNT + INDIRECT_CNT + DBL_INDIRECT_CNT)
+
+/* Ways of finding an inode's data. */
+enum inode_layout
+  {
+    LAYOUT_EXTENTS,                     /* Extents. */
+    LAYOUT_INLINE,                      /* In the inode itself. */
+    LAYOUT_INDEXED                      /* Sector pointers. */
+  };
+
 /* On-disk inode.
-   Must be exactly DISK_SECTOR_SIZE bytes long. */
+   Must be exactly DISK_SECTOR_SIZE bytes long.
+
+   With LAYOUT_EXTENTS, the first INODE_EXTENT_CNT extents, in
+   order of file offset, are stored here.  The rest are stored
+   BLOCK_EXTENT_CNT at a time in a chain of overflow extent
+   blocks.  A file of up to INLINE_MAX bytes starts out with
+   LAYOUT_INLINE instead, so that reading it takes no disk access
+   beyond its inode, and is moved out to a data sector, with
+   LAYOUT_EXTENTS, when it grows past INLINE_MAX.
+
+   With LAYOUT_INDEXED, the inode holds a pointer to each of the
+   first DIRECT_CNT data sectors, a pointer to an indirect block
+   of pointers to the next INDIRECT_CNT, and a pointer to a doubly
+   indirect block of pointers to indirect blocks for the rest.  A
+   pointer of 0 means the sector is a hole: sector 0 always holds
+   the free map inode, so no file's data can live there.  Such a
+   file never has inline data or extents. */
 struct inode_disk
   {
-    disk_sector_t start;                /* First data sector. */
     off_t length;                       /* File size in bytes. */
     unsigned magic;                     /* Magic number. */
-    uint32_t unused[125];               /* Not used. */
+    uint32_t extent_cnt;                /* Total number of extents. */
+    disk_sector_t overflow;             /* First overflow block, or 0. */
+    union
+      {
+        struct extent extents[INODE_EXTENT_CNT]; /* First extents. */
+        uint8_t inline_data[INLINE_MAX]; /* Data, if LAYOUT_INLINE. */
+        struct
+          {
+            disk_sector_t direct[DIRECT_CNT]; /* Data sectors. */
+            disk_sector_t indirect;     /* Block of data sectors. */
+            disk_sector_t doubly_indirect; /* Block of indirect blocks. */
+          };
+      };
+    uint32_t layout;                    /* One of LAYOUT_*. */
   };
 
+/* Overflow extent block.
+   Must be exactly DISK_SECTOR_SIZE bytes long. */
+struct extent_block
+  {
+    disk_sector_t next;                 /* Next overflow block, or 0. */
+    uint32_t unused;                    /* Not used. */
+    struct extent extents[BLOCK_EXTENT_CNT]; /* Following extents. */
+  };
+
+/* Most overflow extent blocks that a file may have, and so most
+   extents.  Inserting an extent rewrites every overflow block
+   after it, all in one journal operation, so this keeps that
+   within what an operation may change (see journal.c). */
+#define EXTENT_BLOCK_MAX 40
+#define EXTENT_MAX (INODE_EXTENT_CNT + EXTENT_BLOCK_MAX * BLOCK_EXTENT_CNT)
+
+/* Most bytes that inode_write_at() writes in one journal
+   operation.  The sectors that each piece allocates change at
+   most one extent or pointer block and one free map sector
+   apiece. */
+#define WRITE_PIECE (32 * DISK_SECTOR_SIZE)
+
+/* Number of sectors that inode_readahead() asks for at a time. */
+#define READAHEAD_SECTORS 8
+
+/* Most sectors of appended data that an inode holds back in its
+   delay buffer before allocating sectors for them. */
+#define DELAY_SECTORS 16
+#define DELAY_BYTES (DELAY_SECTORS * DISK_SECTOR_SIZE)
+
+/* A sector of zeros. */
+static char zeros[DISK_SECTOR_SIZE];
+
+/* Do new files get LAYOUT_INDEXED instead of extents? */
+bool inode_indexed;
+
 /* Returns the number of sectors to allocate for an inode SIZE
    bytes long. */
 static inline size_t
@@ -28,47 +135,172 @@ bytes_to_sectors (off_t size)
   return DIV_ROUND_UP (size, DISK_SECTOR_SIZE);
 }
 
-/* In-memory inode. */
+/* In-memory inode.
+
+   RWLOCK protects DATA, the extents and DENY_WRITE_CNT.  Reads
+   hold it for reading, and so do writes that only overwrite data
+   that already has sectors, so they all run in parallel; a write
+   that allocates sectors or extends the file holds it for
+   writing.  The data itself is protected by the buffer cache.
+   LOCK is not used by inode.c: it is for higher layers that need
+   to make a series of reads and writes atomic, such as
+   directory.c.
+
+   Data written past the last allocated sector of a file that is
+   not journaled does not get sectors right away.  It is held in
+   DELAY_BUF, which covers file bytes DELAY_START up to
+   DELAY_START + DELAY_BYTES, until the buffer fills, the file is
+   closed or the write-behind thread comes around, and then
+   sectors are allocated for all of it at once.  Appending in
+   small pieces, even to several files at a time, thus still
+   gives each file a few long extents instead of many short,
+   interleaved ones.  No sector at or past DELAY_START is
+   allocated while DELAY_BUF is in use, and DELAY_RESERVED free
+   sectors, enough for the data and any overflow extent blocks it
+   needs, are reserved so that the allocation cannot fail. */
 struct inode 
   {
-    struct list_elem elem;              /* Element in inode list. */
+    struct hash_elem elem;              /* Element in open inode table. */
     disk_sector_t sector;               /* Sector number of disk location. */
     int open_cnt;                       /* Number of openers. */
+    bool loading;                       /* Still being read from disk? */
+    bool load_failed;                   /* Reading it failed? */
+    struct condition loaded;            /* Signaled when loading ends. */
     bool removed;                       /* True if deleted, false otherwise. */
     int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
+    bool journaled;                     /* Data written through journal? */
+    struct rwlock rwlock;               /* Protects the members below. */
+    struct lock lock;                   /* For inode_lock(). */
     struct inode_disk data;             /* Inode content. */
+    struct extent *extents;             /* All DATA.extent_cnt extents. */
+    size_t extent_cap;                  /* Capacity of EXTENTS. */
+    disk_sector_t last_block;           /* Last overflow block, or 0. */
+
+    /* Delayed allocation, protected by RWLOCK. */
+    uint8_t *delay_buf;                 /* Delayed data, or null. */
+    off_t delay_start;                  /* File offset of DELAY_BUF. */
+    off_t delay_end;                    /* End of data in DELAY_BUF. */
+    size_t delay_reserved;              /* Sectors reserved for it. */
+    struct list_elem delay_elem;        /* In delayed_inodes list. */
+    bool delay_listed;                  /* In delayed_inodes list? */
   };
 
+static bool load_extents (struct inode *);
+static void save_extents (struct inode *, size_t from);
+static off_t read_run (const struct inode *, void *, off_t offset,
+                       off_t size);
+static bool is_allocated (const struct inode *, off_t offset, off_t size);
+static void write_inline (struct inode *, const void *, off_t size,
+                          off_t offset);
+static bool unpack (struct inode *);
+static bool has_sector (const struct inode *, size_t idx);
+static void write_data (struct inode *, disk_sector_t, const void *,
+                        size_t ofs, size_t size, bool fresh);
+static off_t allocate_range (struct inode *, off_t offset, off_t size,
+                              size_t *reserved);
+static disk_sector_t index_to_sector (const struct inode *, size_t idx);
+static off_t allocate_indexed (struct inode *, off_t offset, off_t size);
+static off_t delay_split (struct inode *, off_t offset, off_t size);
+static void write_delayed (struct inode *, const void *, off_t size,
+                           off_t offset);
+static void trim_delayed (struct inode *);
+static void flush_delayed (struct inode *);
+static void release_blocks (struct inode *);
+
+/* Returns the number of INODE's extents that start at or before
+   file sector IDX, which is also the index at which an extent
+   for IDX would be inserted.  The extents are kept in memory in
+   order of file offset, so this is a binary search that never
+   touches the disk. */
+static size_t
+extent_search (const struct inode *inode, size_t idx)
+{
+  size_t lo = 0, hi = inode->data.extent_cnt;
+
+  while (lo < hi)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+      if (inode->extents[mid].offset <= idx)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  return lo;
+}
+
+/* Returns the extent of INODE that contains file sector IDX, or a
+   null pointer if IDX lies in a hole. */
+static const struct extent *
+find_extent (const struct inode *inode, size_t idx)
+{
+  size_t pos = extent_search (inode, idx);
+
+  if (pos > 0)
+    {
+      const struct extent *e = &inode->extents[pos - 1];
+      if (idx < e->offset + e->length)
+        return e;
+    }
+  return NULL;
+}
+
 /* Returns the disk sector that contains byte offset POS within
    INODE.
    Returns -1 if INODE does not contain data for a byte at offset
-   POS. */
+   POS, either because POS is past end of file or because it lies
+   in a hole that has never been written. */
 static disk_sector_t
 byte_to_sector (const struct inode *inode, off_t pos) 
 {
   ASSERT (inode != NULL);
   if (pos < inode->data.length)
-    return inode->data.start + pos / DISK_SECTOR_SIZE;
-  else
-    return -1;
+    {
+      size_t idx = pos / DISK_SECTOR_SIZE;
+      const struct extent *e;
+
+      if (inode->data.layout == LAYOUT_INDEXED)
+        {
+          disk_sector_t sector = index_to_sector (inode, idx);
+          return sector != 0 ? sector : (disk_sector_t) -1;
+        }
+      e = find_extent (inode, idx);
+      if (e != NULL)
+        return e->start + (idx - e->offset);
+    }
+  return -1;
 }
 
-/* List of open inodes, so that opening a single inode twice
-   returns the same `struct inode'. */
-static struct list open_inodes;
+/* Table of open inodes, indexed by sector, so that opening a
+   single inode twice returns the same `struct inode'.  The lock
+   also protects each open inode's open_cnt, and the list of open
+   inodes whose delay buffers are in use. */
+static struct hash open_inodes;
+static struct list delayed_inodes;
+static struct lock open_inodes_lock;
+
+static hash_hash_func inode_hash;
+static hash_less_func inode_less;
+static struct inode *find_open (disk_sector_t);
 
 /* Initializes the inode module. */
 void
 inode_init (void) 
 {
-  list_init (&open_inodes);
+  if (!hash_init (&open_inodes, inode_hash, inode_less, NULL))
+    PANIC ("open inode table initialization failed");
+  list_init (&delayed_inodes);
+  lock_init (&open_inodes_lock);
 }
 
-/* Initializes an inode with LENGTH bytes of data and
+/* Initializes an inode with LENGTH bytes of data, all zeros, and
    writes the new inode to sector SECTOR on the file system
-   disk.
+   disk.  Must be called within a journal operation.
    Returns true if successful.
-   Returns false if memory or disk allocation fails. */
+   Returns false if memory allocation fails, or if LENGTH is too
+   big for an indexed inode.
+   No data sectors are allocated until the data is written, so
+   this succeeds for any LENGTH even if the disk is full, and
+   writing the data later may then come up short. */
 bool
 inode_create (disk_sector_t sector, off_t length)
 {
@@ -80,26 +312,27 @@ inode_create (disk_sector_t sector, off_t length)
   /* If this assertion fails, the inode structure is not exactly
      one sector in size, and you should fix that. */
   ASSERT (sizeof *disk_inode == DISK_SECTOR_SIZE);
+  ASSERT (sizeof (struct extent_block) == DISK_SECTOR_SIZE);
 
+  /* An extent file starts out inline if it is small enough.
+     Otherwise the file starts out as one big hole, so no data
+     sectors are allocated or written until they are written
+     to. */
+  if (inode_indexed && bytes_to_sectors (length) > INDEXED_SECTOR_CNT)
+    return false;
   disk_inode = calloc (1, sizeof *disk_inode);
   if (disk_inode != NULL)
     {
-      size_t sectors = bytes_to_sectors (length);
       disk_inode->length = length;
       disk_inode->magic = INODE_MAGIC;
-      if (free_map_allocate (sectors, &disk_inode->start))
-        {
-          disk_write (filesys_disk, sector, disk_inode);
-          if (sectors > 0) 
-            {
-              static char zeros[DISK_SECTOR_SIZE];
-              size_t i;
-              
-              for (i = 0; i < sectors; i++) 
-                disk_write (filesys_disk, disk_inode->start + i, zeros); 
-            }
-          success = true; 
-        } 
+      if (inode_indexed)
+        disk_inode->layout = LAYOUT_INDEXED;
+      else if (length <= (off_t) INLINE_MAX)
+        disk_inode->layout = LAYOUT_INLINE;
+      else
+        disk_inode->layout = LAYOUT_EXTENTS;
+      journal_write (sector, disk_inode, 0, DISK_SECTOR_SIZE);
+      success = true; 
       free (disk_inode);
     }
   return success;
@@ -111,33 +344,71 @@ inode_create (disk_sector_t sector, off_t length)
 struct inode *
 inode_open (disk_sector_t sector) 
 {
-  struct list_elem *e;
   struct inode *inode;
+  bool success;
 
-  /* Check whether this inode is already open. */
-  for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
-       e = list_next (e)) 
+  /* Check whether this inode is already open.  If another thread
+     is still reading it in, wait for it to finish. */
+  lock_acquire (&open_inodes_lock);
+  inode = find_open (sector);
+  if (inode != NULL)
     {
-      inode = list_entry (e, struct inode, elem);
-      if (inode->sector == sector) 
+      inode->open_cnt++;
+      while (inode->loading)
+        cond_wait (&inode->loaded, &open_inodes_lock);
+      if (inode->load_failed)
         {
-          inode_reopen (inode);
-          return inode; 
+          if (--inode->open_cnt == 0)
+            free (inode);
+          inode = NULL;
         }
+      lock_release (&open_inodes_lock);
+      return inode;
     }
 
   /* Allocate memory. */
   inode = malloc (sizeof *inode);
   if (inode == NULL)
-    return NULL;
+    {
+      lock_release (&open_inodes_lock);
+      return NULL;
+    }
 
-  /* Initialize. */
-  list_push_front (&open_inodes, &inode->elem);
+  /* Initialize, and put the inode in the table before reading it,
+     so that anyone else who opens it meanwhile waits for us
+     instead of reading it too.  The disk is read without holding
+     the lock. */
   inode->sector = sector;
   inode->open_cnt = 1;
+  inode->loading = true;
+  inode->load_failed = false;
+  cond_init (&inode->loaded);
   inode->deny_write_cnt = 0;
   inode->removed = false;
-  disk_read (filesys_disk, inode->sector, &inode->data);
+  inode->journaled = false;
+  inode->delay_buf = NULL;
+  inode->delay_reserved = 0;
+  inode->delay_listed = false;
+  rwlock_init (&inode->rwlock);
+  lock_init (&inode->lock);
+  hash_insert (&open_inodes, &inode->elem);
+  lock_release (&open_inodes_lock);
+
+  cache_read (inode->sector, &inode->data, 0, DISK_SECTOR_SIZE);
+  success = load_extents (inode);
+
+  lock_acquire (&open_inodes_lock);
+  inode->loading = false;
+  cond_broadcast (&inode->loaded, &open_inodes_lock);
+  if (!success)
+    {
+      hash_delete (&open_inodes, &inode->elem);
+      inode->load_failed = true;
+      if (--inode->open_cnt == 0)
+        free (inode);
+      inode = NULL;
+    }
+  lock_release (&open_inodes_lock);
   return inode;
 }
 
@@ -146,7 +417,11 @@ struct inode *
 inode_reopen (struct inode *inode)
 {
   if (inode != NULL)
-    inode->open_cnt++;
+    {
+      lock_acquire (&open_inodes_lock);
+      inode->open_cnt++;
+      lock_release (&open_inodes_lock);
+    }
   return inode;
 }
 
@@ -163,28 +438,102 @@ inode_get_inumber (const struct inode *inode)
 void
 inode_close (struct inode *inode) 
 {
+  bool last;
+
   /* Ignore null pointer. */
   if (inode == NULL)
     return;
 
+  /* The last opener gives delayed data its sectors first, while
+     INODE is still in the table, so that anyone who opens it
+     meanwhile gets this inode instead of reading the old one from
+     disk.  If someone does, they become the last opener. */
+  for (;;)
+    {
+      lock_acquire (&open_inodes_lock);
+      if (inode->open_cnt > 1 || inode->removed
+          || inode->delay_buf == NULL)
+        break;
+      lock_release (&open_inodes_lock);
+
+      journal_begin ();
+      rwlock_acquire_write (&inode->rwlock);
+      if (inode->delay_buf != NULL)
+        flush_delayed (inode);
+      rwlock_release_write (&inode->rwlock);
+      journal_end ();
+    }
+
   /* Release resources if this was the last opener. */
-  if (--inode->open_cnt == 0)
+  last = --inode->open_cnt == 0;
+  if (last)
+    {
+      hash_delete (&open_inodes, &inode->elem);
+      if (inode->delay_listed)
+        list_remove (&inode->delay_elem);
+    }
+  lock_release (&open_inodes_lock);
+
+  if (last)
     {
-      /* Remove from inode list and release lock. */
-      list_remove (&inode->elem);
- 
       /* Deallocate blocks if removed. */
       if (inode->removed) 
         {
-          free_map_release (inode->sector, 1);
-          free_map_release (inode->data.start,
-                            bytes_to_sectors (inode->data.length)); 
+          journal_begin ();
+          free_map_release_metadata (inode->sector, 1);
+          release_blocks (inode);
+          journal_end ();
+          free_map_unreserve (inode->delay_reserved);
+          free (inode->delay_buf);
         }
 
+      free (inode->extents);
       free (inode); 
     }
 }
 
+/* Allocates sectors for the data in every open inode's delay
+   buffer and writes it to the buffer cache.  Called periodically
+   by the write-behind thread, so that delayed data reaches the
+   disk about as soon as any other dirty data would, and at
+   shutdown. */
+void
+inode_flush_delayed (void)
+{
+  size_t cnt;
+
+  /* Inodes that start delaying again while we work go to the
+     back of the list, so stop after the ones there now. */
+  lock_acquire (&open_inodes_lock);
+  cnt = list_size (&delayed_inodes);
+  lock_release (&open_inodes_lock);
+
+  while (cnt-- > 0)
+    {
+      struct inode *inode = NULL;
+
+      lock_acquire (&open_inodes_lock);
+      if (!list_empty (&delayed_inodes))
+        {
+          inode = list_entry (list_pop_front (&delayed_inodes),
+                              struct inode, delay_elem);
+          inode->delay_listed = false;
+          inode->open_cnt++;
+        }
+      lock_release (&open_inodes_lock);
+      if (inode == NULL)
+        break;
+
+      journal_begin ();
+      rwlock_acquire_write (&inode->rwlock);
+      if (inode->delay_buf != NULL && !inode->delay_listed)
+        flush_delayed (inode);
+      rwlock_release_write (&inode->rwlock);
+      journal_end ();
+      inode_close (inode);
+    }
+}
+
 /* Marks INODE to be deleted when it is closed by the last caller who
    has it open. */
 void
@@ -194,6 +543,30 @@ inode_remove (struct inode *inode)
   inode->removed = true;
 }
 
+/* Acquires INODE's higher-level lock, which inode.c itself never
+   takes, so that the caller can make a series of reads and
+   writes of INODE atomic. */
+void
+inode_lock (struct inode *inode)
+{
+  lock_acquire (&inode->lock);
+}
+
+/* Releases INODE's higher-level lock. */
+void
+inode_unlock (struct inode *inode)
+{
+  lock_release (&inode->lock);
+}
+
+/* Makes writes to INODE's data go through the journal, as
+   befits metadata such as a directory or the free map. */
+void
+inode_set_journaled (struct inode *inode)
+{
+  inode->journaled = true;
+}
+
 /* Reads SIZE bytes from INODE into BUFFER, starting at position OFFSET.
    Returns the number of bytes actually read, which may be less
    than SIZE if an error occurs or end of file is reached. */
@@ -202,8 +575,16 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
 {
   uint8_t *buffer = buffer_;
   off_t bytes_read = 0;
-  uint8_t *bounce = NULL;
 
+  rwlock_acquire_read (&inode->rwlock);
+  if (inode->data.layout == LAYOUT_INLINE && offset < inode->data.length)
+    {
+      /* A small file's data is right in the inode. */
+      off_t inode_left = inode->data.length - offset;
+      bytes_read = size < inode_left ? size : inode_left;
+      memcpy (buffer, inode->data.inline_data + offset, bytes_read);
+      size = 0;
+    }
   while (size > 0) 
     {
       /* Disk sector to read, starting byte offset within sector. */
@@ -220,50 +601,170 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
       if (chunk_size <= 0)
         break;
 
-      if (sector_ofs == 0 && chunk_size == DISK_SECTOR_SIZE) 
-        {
-          /* Read full sector directly into caller's buffer. */
-          disk_read (filesys_disk, sector_idx, buffer + bytes_read); 
-        }
-      else 
-        {
-          /* Read sector into bounce buffer, then partially copy
-             into caller's buffer. */
-          if (bounce == NULL) 
-            {
-              bounce = malloc (DISK_SECTOR_SIZE);
-              if (bounce == NULL)
-                break;
-            }
-          disk_read (filesys_disk, sector_idx, bounce);
-          memcpy (buffer + bytes_read, bounce + sector_ofs, chunk_size);
-        }
+      /* Copy the chunk out of the buffer cache, or read it along
+         with the whole sectors after it if BUFFER is in kernel
+         memory.  A hole reads as zeros. */
+      if (inode->delay_buf != NULL && offset >= inode->delay_start
+          && offset < inode->delay_end)
+        memcpy (buffer + bytes_read,
+                inode->delay_buf + (offset - inode->delay_start), chunk_size);
+      else if (sector_idx == (disk_sector_t) -1)
+        memset (buffer + bytes_read, 0, chunk_size);
+      else if (chunk_size == DISK_SECTOR_SIZE && !inode->journaled
+               && inode->data.layout == LAYOUT_EXTENTS
+               && !is_user_vaddr (buffer))
+        chunk_size = read_run (inode, buffer + bytes_read, offset, size);
+      else
+        cache_read (sector_idx, buffer + bytes_read, sector_ofs, chunk_size);
       
       /* Advance. */
       size -= chunk_size;
       offset += chunk_size;
       bytes_read += chunk_size;
     }
-  free (bounce);
+  rwlock_release_read (&inode->rwlock);
 
   return bytes_read;
 }
 
+/* Starts bringing the READAHEAD_SECTORS sectors of INODE that
+   start with the one holding byte offset OFFSET into the buffer
+   cache in the background, in expectation of a sequential read.
+   Stops at end of file or at a hole. */
+void
+inode_readahead (struct inode *inode, off_t offset) 
+{
+  disk_sector_t sectors[READAHEAD_SECTORS];
+  size_t cnt, i;
+
+  rwlock_acquire_read (&inode->rwlock);
+  for (cnt = 0; cnt < READAHEAD_SECTORS; cnt++)
+    {
+      sectors[cnt] = byte_to_sector (inode,
+                                     offset + cnt * DISK_SECTOR_SIZE);
+      if (sectors[cnt] == (disk_sector_t) -1)
+        break;
+    }
+  rwlock_release_read (&inode->rwlock);
+  for (i = 0; i < cnt; i++)
+    cache_readahead (sectors[i]);
+}
+
 /* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
    Returns the number of bytes actually written, which may be
-   less than SIZE if end of file is reached or an error occurs.
-   (Normally a write at end of file would extend the inode, but
-   growth is not yet implemented.) */
+   less than SIZE if the disk fills up or an error occurs.
+   A write past end of file extends INODE.  Any gap between the
+   old end of file and OFFSET is left as a hole, which reads as
+   zeros and takes no disk space until it is written. */
 off_t
 inode_write_at (struct inode *inode, const void *buffer_, off_t size,
                 off_t offset) 
 {
   const uint8_t *buffer = buffer_;
   off_t bytes_written = 0;
-  uint8_t *bounce = NULL;
+  off_t delayed = 0, split, wanted, allocated;
+  bool exclusive = false, in_op = false;
+  bool fresh_first = false, fresh_last = false;
+
+  /* Make a big write in pieces, each its own journal operation. */
+  if (size > WRITE_PIECE)
+    {
+      while (bytes_written < size)
+        {
+          off_t piece = size - bytes_written;
+          off_t written;
 
+          if (piece > WRITE_PIECE)
+            piece = WRITE_PIECE;
+          written = inode_write_at (inode, buffer + bytes_written, piece,
+                                    offset + bytes_written);
+          bytes_written += written;
+          if (written < piece)
+            break;
+        }
+      return bytes_written;
+    }
+
+  /* A write that only overwrites data sectors of an ordinary file
+     changes no metadata, so it needs no journal operation, and
+     does not take up room in the running transaction that would
+     hold up other writers.  A write that allocates, extends the
+     file or goes to a journaled inode does.  The operation must
+     begin before the inode's lock is taken, so drop the lock to
+     begin it; the checks are made again afterward. */
+  rwlock_acquire_read (&inode->rwlock);
+  if (size > 0 && !inode->deny_write_cnt
+      && (inode->journaled || !is_allocated (inode, offset, size)))
+    {
+      rwlock_release_read (&inode->rwlock);
+      journal_begin ();
+      in_op = true;
+      rwlock_acquire_read (&inode->rwlock);
+    }
   if (inode->deny_write_cnt)
-    return 0;
+    {
+      rwlock_release_read (&inode->rwlock);
+      if (in_op)
+        journal_end ();
+      return 0;
+    }
+
+  /* Allocate sectors for the holes that the write fills, and
+     extend the file if the write ends past end of file.  If the
+     disk fills up, write only what fits.  Both need the lock for
+     writing; the checks are repeated once we have it. */
+  if (size > 0 && !is_allocated (inode, offset, size))
+    {
+      /* Without an operation, the lock has been held since the
+         check above, so nothing can have been freed since. */
+      ASSERT (in_op);
+      rwlock_release_read (&inode->rwlock);
+      rwlock_acquire_write (&inode->rwlock);
+      exclusive = true;
+      if (inode->deny_write_cnt)
+        size = 0;
+      if (inode->data.layout == LAYOUT_INLINE && size > 0)
+        {
+          if (offset + size <= (off_t) INLINE_MAX)
+            {
+              write_inline (inode, buffer, size, offset);
+              bytes_written = size;
+              size = 0;
+            }
+          else if (!unpack (inode))
+            size = 0;
+        }
+
+      /* Appended data may wait in the delay buffer for its
+         sectors, but only once the rest of the write, which comes
+         first in the file, has its sectors.  If the disk fills up
+         before then, none of the appended data is written. */
+      split = delay_split (inode, offset, size);
+      wanted = split - offset;
+      if (wanted > 0)
+        {
+          fresh_first = !has_sector (inode, offset / DISK_SECTOR_SIZE);
+          fresh_last = !has_sector (inode, (offset + wanted - 1)
+                                           / DISK_SECTOR_SIZE);
+        }
+      allocated = allocate_range (inode, offset, wanted, NULL);
+      if (allocated < wanted)
+        {
+          fresh_last = false;
+          trim_delayed (inode);
+        }
+      else if (split < offset + size)
+        {
+          delayed = offset + size - split;
+          write_delayed (inode, buffer + wanted, delayed, split);
+        }
+      size = allocated;
+      if (size > 0 && offset + size > inode_length (inode))
+        {
+          inode->data.length = offset + size;
+          journal_write (inode->sector, &inode->data, 0, DISK_SECTOR_SIZE);
+        }
+    }
 
   while (size > 0) 
     {
@@ -281,38 +782,27 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
       if (chunk_size <= 0)
         break;
 
-      if (sector_ofs == 0 && chunk_size == DISK_SECTOR_SIZE) 
-        {
-          /* Write full sector directly to disk. */
-          disk_write (filesys_disk, sector_idx, buffer + bytes_written); 
-        }
-      else 
-        {
-          /* We need a bounce buffer. */
-          if (bounce == NULL) 
-            {
-              bounce = malloc (DISK_SECTOR_SIZE);
-              if (bounce == NULL)
-                break;
-            }
-
-          /* If the sector contains data before or after the chunk
-             we're writing, then we need to read in the sector
-             first.  Otherwise we start with a sector of all zeros. */
-          if (sector_ofs > 0 || chunk_size < sector_left) 
-            disk_read (filesys_disk, sector_idx, bounce);
-          else
-            memset (bounce, 0, DISK_SECTOR_SIZE);
-          memcpy (bounce + sector_ofs, buffer + bytes_written, chunk_size);
-          disk_write (filesys_disk, sector_idx, bounce); 
-        }
+      /* Copy the chunk into the buffer cache, which reads the rest
+         of the sector from disk first if the chunk is partial.
+         Only the first and last chunks can be partial, and if
+         their sectors were just allocated then the rest of them
+         is zeros instead, as it read while it was a hole. */
+      write_data (inode, sector_idx, buffer + bytes_written, sector_ofs,
+                  chunk_size, ((bytes_written == 0 && fresh_first)
+                               || (chunk_size == size && fresh_last)));
 
       /* Advance. */
       size -= chunk_size;
       offset += chunk_size;
       bytes_written += chunk_size;
     }
-  free (bounce);
+  bytes_written += delayed;
+  if (exclusive)
+    rwlock_release_write (&inode->rwlock);
+  else
+    rwlock_release_read (&inode->rwlock);
+  if (in_op)
+    journal_end ();
 
   return bytes_written;
 }
@@ -322,8 +812,10 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
 void
 inode_deny_write (struct inode *inode) 
 {
+  rwlock_acquire_write (&inode->rwlock);
   inode->deny_write_cnt++;
   ASSERT (inode->deny_write_cnt <= inode->open_cnt);
+  rwlock_release_write (&inode->rwlock);
 }
 
 /* Re-enables writes to INODE.
@@ -332,9 +824,11 @@ inode_deny_write (struct inode *inode)
 void
 inode_allow_write (struct inode *inode) 
 {
+  rwlock_acquire_write (&inode->rwlock);
   ASSERT (inode->deny_write_cnt > 0);
   ASSERT (inode->deny_write_cnt <= inode->open_cnt);
   inode->deny_write_cnt--;
+  rwlock_release_write (&inode->rwlock);
 }
 
 /* Returns the length, in bytes, of INODE's data. */
@@ -343,3 +837,809 @@ inode_length (const struct inode *inode)
 {
   return inode->data.length;
 }
+
+/* Returns the open inode for SECTOR, or a null pointer if it is
+   not open.  The caller must hold OPEN_INODES_LOCK. */
+static struct inode *
+find_open (disk_sector_t sector)
+{
+  struct inode key;
+  struct hash_elem *e;
+
+  key.sector = sector;
+  e = hash_find (&open_inodes, &key.elem);
+  return e != NULL ? hash_entry (e, struct inode, elem) : NULL;
+}
+
+/* Returns a hash value for inode I. */
+static unsigned
+inode_hash (const struct hash_elem *i_, void *aux UNUSED)
+{
+  const struct inode *i = hash_entry (i_, struct inode, elem);
+  return hash_int (i->sector);
+}
+
+/* Returns true if inode A precedes inode B. */
+static bool
+inode_less (const struct hash_elem *a_, const struct hash_elem *b_,
+            void *aux UNUSED)
+{
+  const struct inode *a = hash_entry (a_, struct inode, elem);
+  const struct inode *b = hash_entry (b_, struct inode, elem);
+
+  return a->sector < b->sector;
+}
+
+/* Loads all of INODE's extents into memory, given that
+   INODE->data has been read.  Returns true if successful, false
+   if memory allocation fails. */
+static bool
+load_extents (struct inode *inode)
+{
+  size_t cnt = inode->data.extent_cnt;
+  disk_sector_t block = inode->data.overflow;
+  size_t i;
+
+  inode->extent_cap = cnt > INODE_EXTENT_CNT ? cnt : INODE_EXTENT_CNT;
+  inode->extents = malloc (inode->extent_cap * sizeof *inode->extents);
+  if (inode->extents == NULL)
+    return false;
+  memcpy (inode->extents, inode->data.extents,
+          (cnt < INODE_EXTENT_CNT ? cnt : INODE_EXTENT_CNT)
+          * sizeof *inode->extents);
+
+  inode->last_block = 0;
+  for (i = INODE_EXTENT_CNT; i < cnt; i += BLOCK_EXTENT_CNT)
+    {
+      size_t n = cnt - i < BLOCK_EXTENT_CNT ? cnt - i : BLOCK_EXTENT_CNT;
+      cache_read (block, inode->extents + i,
+                  offsetof (struct extent_block, extents),
+                  n * sizeof *inode->extents);
+      inode->last_block = block;
+      cache_read (block, &block, offsetof (struct extent_block, next),
+                  sizeof block);
+    }
+  return true;
+}
+
+/* Returns the overflow block that holds extent IDX of INODE,
+   which must be stored in one. */
+static disk_sector_t
+extent_block (const struct inode *inode, size_t idx)
+{
+  size_t last = (inode->data.extent_cnt - 1 - INODE_EXTENT_CNT)
+                / BLOCK_EXTENT_CNT;
+  size_t n = (idx - INODE_EXTENT_CNT) / BLOCK_EXTENT_CNT;
+  disk_sector_t block;
+
+  ASSERT (idx >= INODE_EXTENT_CNT && idx < inode->data.extent_cnt);
+
+  if (n == last)
+    return inode->last_block;
+  for (block = inode->data.overflow; n > 0; n--)
+    cache_read (block, &block, offsetof (struct extent_block, next),
+                sizeof block);
+  return block;
+}
+
+/* Writes INODE's header and its extents FROM onward to disk.
+   The overflow blocks they need must already exist. */
+static void
+save_extents (struct inode *inode, size_t from)
+{
+  size_t cnt = inode->data.extent_cnt;
+  disk_sector_t block;
+  size_t i;
+
+  memcpy (inode->data.extents, inode->extents,
+          (cnt < INODE_EXTENT_CNT ? cnt : INODE_EXTENT_CNT)
+          * sizeof *inode->extents);
+  journal_write (inode->sector, &inode->data, 0, DISK_SECTOR_SIZE);
+
+  if (from < INODE_EXTENT_CNT)
+    from = INODE_EXTENT_CNT;
+  if (from >= cnt)
+    return;
+  block = extent_block (inode, from);
+  for (i = from; ; )
+    {
+      size_t ofs = (i - INODE_EXTENT_CNT) % BLOCK_EXTENT_CNT;
+      size_t n = BLOCK_EXTENT_CNT - ofs;
+      if (n > cnt - i)
+        n = cnt - i;
+
+      journal_write (block, inode->extents + i,
+                     offsetof (struct extent_block, extents)
+                     + ofs * sizeof *inode->extents,
+                     n * sizeof *inode->extents);
+      i += n;
+      if (i >= cnt)
+        break;
+      cache_read (block, &block, offsetof (struct extent_block, next),
+                  sizeof block);
+    }
+}
+
+/* Inserts a new extent into INODE at index POS, with the given
+   OFFSET, START and LENGTH, growing the in-memory array and
+   allocating a new overflow block if necessary, from the
+   caller's *RESERVED sectors if RESERVED is non-null.  Does not
+   write the extents to disk.  Returns true if successful, false
+   if out of memory or disk space or if INODE already has
+   EXTENT_MAX extents. */
+static bool
+insert_extent (struct inode *inode, size_t pos, size_t offset,
+               disk_sector_t start, size_t length, size_t *reserved)
+{
+  size_t cnt = inode->data.extent_cnt;
+  struct extent *e;
+
+  ASSERT (pos <= cnt);
+
+  if (cnt >= EXTENT_MAX)
+    return false;
+  if (cnt == inode->extent_cap)
+    {
+      size_t cap = inode->extent_cap * 2;
+      struct extent *extents = realloc (inode->extents,
+                                        cap * sizeof *extents);
+      if (extents == NULL)
+        return false;
+      inode->extents = extents;
+      inode->extent_cap = cap;
+    }
+
+  /* An extent that overflows into a new overflow block needs
+     that block to be allocated, and linked onto the end of the
+     chain. */
+  if (cnt >= INODE_EXTENT_CNT
+      && (cnt - INODE_EXTENT_CNT) % BLOCK_EXTENT_CNT == 0)
+    {
+      static struct extent_block zeros;
+      disk_sector_t block;
+
+      if (!free_map_allocate_near (1, inode->sector, &block, reserved))
+        return false;
+      journal_write (block, &zeros, 0, DISK_SECTOR_SIZE);
+      if (inode->last_block == 0)
+        inode->data.overflow = block;
+      else
+        journal_write (inode->last_block, &block,
+                       offsetof (struct extent_block, next), sizeof block);
+      inode->last_block = block;
+    }
+
+  e = &inode->extents[pos];
+  memmove (e + 1, e, (cnt - pos) * sizeof *e);
+  e->offset = offset;
+  e->start = start;
+  e->length = length;
+  inode->data.extent_cnt++;
+  return true;
+}
+
+/* Allocates up to CNT sectors for a hole in INODE's data that
+   starts at file sector IDX, where POS is extent_search()'s
+   result for IDX.  Grows the extent before the hole in place if
+   it ends at IDX and the disk sectors after it are free,
+   otherwise allocates the longest run it can find, up to CNT
+   sectors, as a new extent, as close after the data before it
+   (or the inode) as possible.  Allocates from the caller's
+   *RESERVED sectors if RESERVED is non-null.  Returns the number
+   of sectors allocated, 0 if the disk is full. */
+static size_t
+allocate_run (struct inode *inode, size_t pos, size_t idx, size_t cnt,
+              size_t *reserved)
+{
+  struct extent *prev = NULL;
+  disk_sector_t start, hint;
+  size_t grown = 0;
+
+  /* Keep the data right after the data before it, or after the
+     inode itself for the start of the file. */
+  hint = inode->sector + 1;
+  if (pos > 0)
+    {
+      prev = &inode->extents[pos - 1];
+      hint = prev->start + prev->length;
+      if (prev->offset + prev->length == idx)
+        grown = free_map_allocate_at (hint, cnt, reserved);
+    }
+
+  if (grown > 0)
+    {
+      start = prev->start + prev->length;
+      prev->length += grown;
+      cnt = grown;
+    }
+  else
+    {
+      while (!free_map_allocate_near (cnt, hint, &start, reserved))
+        if ((cnt /= 2) == 0)
+          return 0;
+      if (!insert_extent (inode, pos, idx, start, cnt, reserved))
+        {
+          free_map_release (start, cnt);
+          return 0;
+        }
+    }
+  return cnt;
+}
+
+/* Reads the whole sectors of INODE's data from sector-aligned
+   OFFSET onward into BUFFER, up to SIZE bytes, stopping at end of
+   file or at the end of the extent that contains OFFSET.  Returns
+   the number of bytes read.
+
+   If there are at least two such sectors, they are consecutive
+   on disk, so those that are not cached are read from disk
+   straight into BUFFER, several at a time, with no copy through
+   the cache.  A single sector is read through the cache as
+   usual, so that small repeated reads still hit.  INODE must not
+   be journaled, and its lock must be held.  BUFFER must be in
+   kernel memory (see cache_read_sectors()). */
+static off_t
+read_run (const struct inode *inode, void *buffer, off_t offset, off_t size)
+{
+  size_t idx = offset / DISK_SECTOR_SIZE;
+  const struct extent *e = find_extent (inode, idx);
+  off_t left = inode->data.length - offset;
+  size_t cnt;
+
+  ASSERT (offset % DISK_SECTOR_SIZE == 0);
+  ASSERT (e != NULL);
+
+  cnt = (size < left ? size : left) / DISK_SECTOR_SIZE;
+  if (cnt > e->offset + e->length - idx)
+    cnt = e->offset + e->length - idx;
+  if (cnt < 2)
+    {
+      cache_read (e->start + (idx - e->offset), buffer, 0, DISK_SECTOR_SIZE);
+      return DISK_SECTOR_SIZE;
+    }
+  cache_read_sectors (e->start + (idx - e->offset), cnt, buffer);
+  return cnt * DISK_SECTOR_SIZE;
+}
+
+/* Returns true if the bytes of INODE between offsets OFFSET and
+   OFFSET + SIZE all lie before end of file and have data
+   sectors, so that writing them changes no metadata. */
+static bool
+is_allocated (const struct inode *inode, off_t offset, off_t size)
+{
+  size_t idx = offset / DISK_SECTOR_SIZE;
+  size_t end = bytes_to_sectors (offset + size);
+
+  if (inode->data.layout == LAYOUT_INLINE
+      || offset + size > inode->data.length)
+    return false;
+  if (inode->data.layout == LAYOUT_INDEXED)
+    {
+      for (; idx < end; idx++)
+        if (index_to_sector (inode, idx) == 0)
+          return false;
+      return true;
+    }
+  while (idx < end)
+    {
+      const struct extent *e = find_extent (inode, idx);
+      if (e == NULL)
+        return false;
+      idx = e->offset + e->length;
+    }
+  return true;
+}
+
+/* Writes SIZE bytes from BUFFER into inline INODE, starting at
+   OFFSET, extending the file if the write ends past end of file.
+   The bytes must fit inline. */
+static void
+write_inline (struct inode *inode, const void *buffer, off_t size,
+              off_t offset)
+{
+  ASSERT (offset + size <= (off_t) INLINE_MAX);
+
+  /* The inline bytes past end of file are always zeros, so any
+     gap before OFFSET reads as zeros without clearing it. */
+  memcpy (inode->data.inline_data + offset, buffer, size);
+  if (offset + size > inode->data.length)
+    inode->data.length = offset + size;
+  journal_write (inode->sector, &inode->data, 0, DISK_SECTOR_SIZE);
+}
+
+/* Moves inline INODE's data out to a data sector of its own, so
+   that the file can grow past INLINE_MAX bytes.  Returns true if
+   successful, false if the disk is full. */
+static bool
+unpack (struct inode *inode)
+{
+  off_t length = inode->data.length;
+  disk_sector_t sector = 0;
+
+  if (length > 0)
+    {
+      if (!free_map_allocate_near (1, inode->sector + 1, &sector, NULL))
+        return false;
+      write_data (inode, sector, inode->data.inline_data, 0, length, true);
+    }
+
+  inode->data.layout = LAYOUT_EXTENTS;
+  memset (inode->data.extents, 0, sizeof inode->data.extents);
+  if (length > 0)
+    {
+      /* The in-memory extent array has room for at least
+         INODE_EXTENT_CNT extents, so this cannot fail. */
+      if (!insert_extent (inode, 0, 0, sector, 1, NULL))
+        NOT_REACHED ();
+    }
+  save_extents (inode, 0);
+  return true;
+}
+
+/* Returns true if file sector IDX of INODE has a data sector,
+   whether or not it lies before end of file. */
+static bool
+has_sector (const struct inode *inode, size_t idx)
+{
+  if (inode->data.layout == LAYOUT_INDEXED)
+    return index_to_sector (inode, idx) != 0;
+  return find_extent (inode, idx) != NULL;
+}
+
+/* Writes SIZE bytes from BUFFER into data SECTOR of INODE,
+   starting at OFS within the sector, through the journal if
+   INODE is journaled.  If FRESH, SECTOR has just been allocated,
+   and the rest of it is set to zeros. */
+static void
+write_data (struct inode *inode, disk_sector_t sector, const void *buffer,
+            size_t ofs, size_t size, bool fresh)
+{
+  if (inode->journaled)
+    {
+      /* A whole-sector image needs no read, so this only costs
+         a copy. */
+      if (fresh && size < DISK_SECTOR_SIZE)
+        journal_write (sector, zeros, 0, DISK_SECTOR_SIZE);
+      journal_write (sector, buffer, ofs, size);
+    }
+  else if (fresh)
+    cache_write_zeroed (sector, buffer, ofs, size);
+  else
+    cache_write (sector, buffer, ofs, size);
+}
+
+/* Allocates sectors for every hole in INODE's data between byte
+   offsets OFFSET and OFFSET + SIZE, and writes the changed
+   extents to disk.  The new sectors are not written: the caller
+   must write all of them, zeroing any part of one that it does
+   not fill.  Sectors come from the caller's *RESERVED sectors if
+   RESERVED is non-null, which INODE must then not be indexed.
+   Returns SIZE if successful.  If the disk fills up, returns the
+   number of bytes starting at OFFSET that have data sectors,
+   which may be 0. */
+static off_t
+allocate_range (struct inode *inode, off_t offset, off_t size,
+                size_t *reserved)
+{
+  size_t idx = offset / DISK_SECTOR_SIZE;
+  size_t end = bytes_to_sectors (offset + size);
+  size_t first = SIZE_MAX;
+
+  if (size <= 0)
+    return 0;
+  if (inode->data.layout == LAYOUT_INDEXED)
+    {
+      ASSERT (reserved == NULL);
+      return allocate_indexed (inode, offset, size);
+    }
+
+  while (idx < end)
+    {
+      size_t pos = extent_search (inode, idx);
+      const struct extent *e = find_extent (inode, idx);
+      size_t hole_end, cnt, changed;
+
+      if (e != NULL)
+        {
+          idx = e->offset + e->length;
+          continue;
+        }
+
+      /* The hole runs up to the next extent, if any. */
+      hole_end = end;
+      if (pos < inode->data.extent_cnt
+          && inode->extents[pos].offset < hole_end)
+        hole_end = inode->extents[pos].offset;
+
+      cnt = allocate_run (inode, pos, idx, hole_end - idx, reserved);
+      if (cnt == 0)
+        break;
+      idx += cnt;
+
+      /* The extent before the hole may have grown. */
+      changed = pos > 0 ? pos - 1 : 0;
+      if (changed < first)
+        first = changed;
+    }
+
+  if (first != SIZE_MAX)
+    save_extents (inode, first);
+  if (idx < end)
+    size = (off_t) (idx * DISK_SECTOR_SIZE) > offset
+           ? (off_t) (idx * DISK_SECTOR_SIZE) - offset : 0;
+  return size;
+}
+
+/* Returns the file offset just past INODE's last allocated data
+   sector, or 0 if it has none. */
+static off_t
+allocated_end (const struct inode *inode)
+{
+  size_t cnt = inode->data.extent_cnt;
+  const struct extent *e;
+
+  if (cnt == 0)
+    return 0;
+  e = &inode->extents[cnt - 1];
+  return (off_t) (e->offset + e->length) * DISK_SECTOR_SIZE;
+}
+
+/* Returns the number of sectors to reserve for SIZE bytes of
+   delayed data: one for each data sector, plus an overflow block
+   for every BLOCK_EXTENT_CNT of them in case each one ends up in
+   an extent of its own. */
+static size_t
+delay_need (off_t size)
+{
+  size_t cnt = bytes_to_sectors (size);
+  return cnt + DIV_ROUND_UP (cnt, BLOCK_EXTENT_CNT);
+}
+
+/* Makes room in INODE's delay buffer for the part of a write of
+   SIZE bytes at OFFSET that lies past INODE's last allocated
+   sector, and reserves sectors for it.  Returns the file offset
+   at which that part starts.  The caller then allocates sectors
+   for the rest of the write, which comes first, and passes the
+   part to write_delayed(), or calls trim_delayed() if it cannot.
+   Returns OFFSET + SIZE if none of the write can be delayed,
+   because INODE is journaled or the part past the last allocated
+   sector is too big to delay or there is no room to reserve for
+   it.  In that case the delay buffer has been flushed, so the
+   caller may allocate sectors for the whole write.  INODE's lock
+   must be held for writing. */
+static off_t
+delay_split (struct inode *inode, off_t offset, off_t size)
+{
+  off_t end = offset + size;
+  off_t split;
+  size_t need;
+
+  if (size <= 0 || inode->journaled
+      || inode->data.layout != LAYOUT_EXTENTS)
+    return end;
+  split = allocated_end (inode);
+  if (split < offset)
+    split = offset;
+  if (split >= end)
+    return end;
+
+  /* Data that doesn't fit in the delay buffer pushes out what is
+     in it, and then may start a new one. */
+  if (inode->delay_buf != NULL
+      && (split < inode->delay_start
+          || end > inode->delay_start + DELAY_BYTES))
+    {
+      flush_delayed (inode);
+      return delay_split (inode, offset, size);
+    }
+
+  if (inode->delay_buf == NULL)
+    {
+      off_t start = ROUND_DOWN (split, DISK_SECTOR_SIZE);
+
+      /* A write this big gets a long run of sectors anyway. */
+      if (end > start + DELAY_BYTES)
+        return end;
+      inode->delay_buf = calloc (1, DELAY_BYTES);
+      if (inode->delay_buf == NULL)
+        return end;
+      inode->delay_start = inode->delay_end = start;
+
+      lock_acquire (&open_inodes_lock);
+      if (!inode->delay_listed)
+        {
+          list_push_back (&delayed_inodes, &inode->delay_elem);
+          inode->delay_listed = true;
+        }
+      lock_release (&open_inodes_lock);
+    }
+
+  need = delay_need (end - inode->delay_start);
+  if (need > inode->delay_reserved)
+    {
+      if (!free_map_reserve (need - inode->delay_reserved))
+        {
+          flush_delayed (inode);
+          return end;
+        }
+      inode->delay_reserved = need;
+    }
+  return split;
+}
+
+/* Copies SIZE bytes from BUFFER into INODE's delay buffer at file
+   offset OFFSET, which delay_split() has made room and reserved
+   sectors for, and extends the file if they end past end of
+   file.  INODE's lock must be held for writing. */
+static void
+write_delayed (struct inode *inode, const void *buffer, off_t size,
+               off_t offset)
+{
+  off_t end = offset + size;
+
+  memcpy (inode->delay_buf + (offset - inode->delay_start), buffer, size);
+  if (end > inode->delay_end)
+    inode->delay_end = end;
+  if (end > inode->data.length)
+    inode->data.length = end;
+}
+
+/* Gives back the sectors reserved for INODE's delay buffer beyond
+   those that its contents need, which delay_split() reserved for
+   a write that then came up short.  INODE's lock must be held
+   for writing. */
+static void
+trim_delayed (struct inode *inode)
+{
+  size_t need;
+
+  if (inode->delay_buf == NULL)
+    return;
+  need = delay_need (inode->delay_end - inode->delay_start);
+  if (need < inode->delay_reserved)
+    {
+      free_map_unreserve (inode->delay_reserved - need);
+      inode->delay_reserved = need;
+    }
+}
+
+/* Allocates sectors for the data in INODE's delay buffer, as few
+   runs as possible, out of the sectors reserved for it, and
+   writes the data to them.  Then frees the buffer and gives back
+   what is left of the reservation.  The reservation covers every
+   sector needed, so only running out of memory can leave some of
+   the data without sectors.  That data is dropped, leaving a
+   hole, and if the file ended in it, the file now ends where the
+   data that was written does.  INODE's lock must be held for
+   writing, or INODE must have no other openers, and a journal
+   operation must be open. */
+static void
+flush_delayed (struct inode *inode)
+{
+  off_t size = inode->delay_end - inode->delay_start;
+  off_t done, ofs;
+
+  ASSERT (inode->delay_buf != NULL);
+
+  done = allocate_range (inode, inode->delay_start, size,
+                         &inode->delay_reserved);
+  free_map_unreserve (inode->delay_reserved);
+  inode->delay_reserved = 0;
+  for (ofs = 0; ofs < done; ofs += DISK_SECTOR_SIZE)
+    cache_write (byte_to_sector (inode, inode->delay_start + ofs),
+                 inode->delay_buf + ofs, 0, DISK_SECTOR_SIZE);
+  if (done < size && inode->data.length <= inode->delay_end)
+    inode->data.length = inode->delay_start + done;
+  journal_write (inode->sector, &inode->data, 0, DISK_SECTOR_SIZE);
+
+  free (inode->delay_buf);
+  inode->delay_buf = NULL;
+}
+
+/* Returns pointer IDX in pointer block BLOCK, read through the
+   buffer cache. */
+static disk_sector_t
+read_ptr (disk_sector_t block, size_t idx)
+{
+  disk_sector_t sector;
+
+  cache_read (block, &sector, idx * sizeof sector, sizeof sector);
+  return sector;
+}
+
+/* Sets pointer IDX in pointer block BLOCK to SECTOR. */
+static void
+write_ptr (disk_sector_t block, size_t idx, disk_sector_t sector)
+{
+  journal_write (block, &sector, idx * sizeof sector, sizeof sector);
+}
+
+/* Returns the sector that holds data sector IDX of indexed INODE,
+   or 0 if there is none.  At most two pointer blocks are
+   consulted, each through the buffer cache, so lookups are cheap
+   for any offset. */
+static disk_sector_t
+index_to_sector (const struct inode *inode, size_t idx)
+{
+  const struct inode_disk *d = &inode->data;
+  disk_sector_t block;
+
+  if (idx < DIRECT_CNT)
+    return d->direct[idx];
+  idx -= DIRECT_CNT;
+
+  if (idx < INDIRECT_CNT)
+    return d->indirect != 0 ? read_ptr (d->indirect, idx) : 0;
+  idx -= INDIRECT_CNT;
+
+  if (idx < DBL_INDIRECT_CNT)
+    {
+      block = (d->doubly_indirect != 0
+               ? read_ptr (d->doubly_indirect, idx / PTRS_PER_SECTOR) : 0);
+      return block != 0 ? read_ptr (block, idx % PTRS_PER_SECTOR) : 0;
+    }
+  return 0;
+}
+
+/* If *BLOCK is 0, allocates an empty pointer block near HINT and
+   stores its number in *BLOCK.  Returns false if the disk is
+   full. */
+static bool
+need_ptr_block (disk_sector_t *block, disk_sector_t hint)
+{
+  if (*block == 0)
+    {
+      if (!free_map_allocate_near (1, hint, block, NULL))
+        return false;
+      journal_write (*block, zeros, 0, DISK_SECTOR_SIZE);
+    }
+  return true;
+}
+
+/* Points data sector IDX of indexed INODE, which must be less
+   than INDEXED_SECTOR_CNT, at SECTOR, allocating the pointer
+   blocks needed to reach it.  Does not write the inode itself to
+   disk.  Returns false if the disk is full. */
+static bool
+index_set (struct inode *inode, size_t idx, disk_sector_t sector)
+{
+  struct inode_disk *d = &inode->data;
+  disk_sector_t block;
+
+  ASSERT (idx < INDEXED_SECTOR_CNT);
+
+  if (idx < DIRECT_CNT)
+    {
+      d->direct[idx] = sector;
+      return true;
+    }
+  idx -= DIRECT_CNT;
+
+  if (idx < INDIRECT_CNT)
+    {
+      if (!need_ptr_block (&d->indirect, sector))
+        return false;
+      block = d->indirect;
+    }
+  else
+    {
+      idx -= INDIRECT_CNT;
+      if (!need_ptr_block (&d->doubly_indirect, sector))
+        return false;
+      block = read_ptr (d->doubly_indirect, idx / PTRS_PER_SECTOR);
+      if (block == 0)
+        {
+          if (!need_ptr_block (&block, sector))
+            return false;
+          write_ptr (d->doubly_indirect, idx / PTRS_PER_SECTOR, block);
+        }
+      idx %= PTRS_PER_SECTOR;
+    }
+  write_ptr (block, idx, sector);
+  return true;
+}
+
+/* Allocates a sector for every hole in indexed INODE's data
+   between byte offsets OFFSET and OFFSET + SIZE, each one
+   as close after the sector before it as possible, and writes
+   the changed pointers to disk.  Returns SIZE if successful.  If
+   the disk fills up, or the file would outgrow what its pointers
+   can address, returns the number of bytes starting at OFFSET
+   that have data sectors, which may be 0. */
+static off_t
+allocate_indexed (struct inode *inode, off_t offset, off_t size)
+{
+  size_t idx = offset / DISK_SECTOR_SIZE;
+  size_t end = bytes_to_sectors (offset + size);
+  disk_sector_t hint = inode->sector;
+  bool changed = false;
+
+  if (idx > 0 && index_to_sector (inode, idx - 1) != 0)
+    hint = index_to_sector (inode, idx - 1);
+  for (; idx < end; idx++)
+    {
+      disk_sector_t sector = index_to_sector (inode, idx);
+
+      if (sector == 0)
+        {
+          if (idx >= INDEXED_SECTOR_CNT
+              || !free_map_allocate_near (1, hint + 1, &sector, NULL))
+            break;
+          if (!index_set (inode, idx, sector))
+            {
+              free_map_release (sector, 1);
+              break;
+            }
+          changed = true;
+        }
+      hint = sector;
+    }
+
+  if (changed)
+    journal_write (inode->sector, &inode->data, 0, DISK_SECTOR_SIZE);
+  if (idx < end)
+    size = (off_t) (idx * DISK_SECTOR_SIZE) > offset
+           ? (off_t) (idx * DISK_SECTOR_SIZE) - offset : 0;
+  return size;
+}
+
+/* Releases CNT of INODE's sectors starting at SECTOR.  If they
+   are METADATA, or data of a journaled INODE, they are held back
+   from reuse until the release is committed. */
+static void
+release (const struct inode *inode, disk_sector_t sector, size_t cnt,
+         bool metadata)
+{
+  if (metadata || inode->journaled)
+    free_map_release_metadata (sector, cnt);
+  else
+    free_map_release (sector, cnt);
+}
+
+/* Releases SECTOR of INODE, which is a pointer block LEVELS
+   levels above the data it leads to (0 for a data sector), and
+   everything it points to.  Does nothing if SECTOR is 0. */
+static void
+release_tree (const struct inode *inode, disk_sector_t sector, int levels)
+{
+  if (sector == 0)
+    return;
+  if (levels > 0)
+    {
+      size_t i;
+
+      for (i = 0; i < PTRS_PER_SECTOR; i++)
+        release_tree (inode, read_ptr (sector, i), levels - 1);
+    }
+  release (inode, sector, 1, levels > 0);
+}
+
+/* Releases all of INODE's data sectors and overflow or pointer
+   blocks.  The blocks, and the data if INODE is journaled, are
+   metadata. */
+static void
+release_blocks (struct inode *inode)
+{
+  disk_sector_t block = inode->data.overflow;
+  size_t i;
+
+  if (inode->data.layout == LAYOUT_INDEXED)
+    {
+      for (i = 0; i < DIRECT_CNT; i++)
+        release_tree (inode, inode->data.direct[i], 0);
+      release_tree (inode, inode->data.indirect, 1);
+      release_tree (inode, inode->data.doubly_indirect, 2);
+      return;
+    }
+  for (i = 0; i < inode->data.extent_cnt; i++)
+    release (inode, inode->extents[i].start, inode->extents[i].length,
+             false);
+  while (block != 0)
+    {
+      disk_sector_t next;
+      cache_read (block, &next, offsetof (struct extent_block, next),
+                  sizeof next);
+      release (inode, block, 1, true);
+      block = next;
+    }
+}
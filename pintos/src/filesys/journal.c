@@ -0,0 +1,574 @@
+#include "filesys/journal.h"
+#include <debug.h>
+#include <hash.h>
+#include <round.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "filesys/cache.h"
+#include "filesys/filesys.h"
+#include "filesys/free-map.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+
+/* The journal makes metadata updates atomic across crashes.
+
+   Every change to an inode, an overflow extent block or pointer
+   block, a directory or the free map is made inside an
+   operation, bracketed by journal_begin() and journal_end(),
+   with journal_write() instead of cache_write().  journal_write()
+   keeps an image of each changed sector in memory, as part of
+   the running transaction, and marks the cached copy "logged" so
+   that the buffer cache never writes it back itself.  Any number
+   of operations join the running transaction until it is
+   committed, which happens every time the write-behind thread
+   runs and whenever the transaction grows past TXN_COMMIT_CNT
+   sectors.
+
+   A commit waits for the operations in progress to finish and
+   writes the transaction sequentially to the log: descriptor
+   blocks listing the home sectors, the sector images, and then a
+   commit record.  The images are not written to their home
+   sectors until the next commit (a "checkpoint"), which must
+   happen before the log is reused, so the log only ever holds
+   one transaction.  Pintos disk writes complete in order, so a
+   commit record on disk means the whole transaction is there.
+
+   At mount time, the transaction in the log is replayed if its
+   commit record made it to disk and it has not been
+   checkpointed, so recovery reads at most one log's worth of
+   sectors however large the disk is.
+
+   Only metadata is journaled: file data goes straight through
+   the buffer cache, so a crash can leave stale data in a file,
+   but never a corrupt file system.  There are two exceptions.
+   A small file's data, kept inline in its inode, shares the
+   inode's sector, so write_inline() journals it with the rest of
+   the inode; a crash leaves such a file's data and length
+   consistent, at the cost of logging a whole sector per write.
+   And the free map file is metadata itself, so inodes marked by
+   inode_set_journaled() have their data journaled too. */
+
+/* Magic numbers of the journal's sectors. */
+#define HEADER_MAGIC 0x4a524e4c         /* Journal header. */
+#define DESC_MAGIC 0x44455343           /* Descriptor block. */
+#define COMMIT_MAGIC 0x434d4954         /* Commit record. */
+
+/* The log follows the journal header. */
+#define LOG_START (JOURNAL_START + 1)
+
+/* Number of home sectors listed in each descriptor block. */
+#define DESC_SECTORS 125
+
+/* Most sectors that a transaction may change, so that its
+   descriptor blocks, images and commit record fit in the log. */
+#define TXN_MAX 250
+
+/* A running transaction that has changed this many sectors is
+   committed as soon as an operation ends. */
+#define TXN_COMMIT_CNT 64
+
+/* Most sectors that one operation may change.  An operation
+   reserves room for this many in the running transaction when it
+   begins, so that the transaction never has to grow past TXN_MAX
+   in the middle of one.  Nothing the file system does in one
+   operation changes more than this: inode_write_at() makes a big
+   write in pieces, each its own operation, a file's extents have
+   at most EXTENT_BLOCK_MAX overflow blocks, and a directory has at
+   most MAX_BUCKETS buckets. */
+#define OP_MAX 96
+
+/* Journal header, in sector JOURNAL_START.
+   Must be exactly DISK_SECTOR_SIZE bytes long. */
+struct journal_header
+  {
+    unsigned magic;                     /* HEADER_MAGIC. */
+    uint32_t checkpointed;              /* Last transaction written home. */
+    uint32_t unused[126];               /* Not used. */
+  };
+
+/* Descriptor block.
+   Must be exactly DISK_SECTOR_SIZE bytes long. */
+struct journal_desc
+  {
+    unsigned magic;                     /* DESC_MAGIC. */
+    uint32_t seq;                       /* Transaction sequence number. */
+    uint32_t cnt;                       /* Sectors in the transaction. */
+    disk_sector_t sectors[DESC_SECTORS]; /* Home sectors of images. */
+  };
+
+/* Commit record.
+   Must be exactly DISK_SECTOR_SIZE bytes long. */
+struct commit_record
+  {
+    unsigned magic;                     /* COMMIT_MAGIC. */
+    uint32_t seq;                       /* Transaction sequence number. */
+    uint32_t cnt;                       /* Sectors in the transaction. */
+    uint32_t unused[125];               /* Not used. */
+  };
+
+/* The latest contents of a sector changed by a transaction. */
+struct image
+  {
+    struct hash_elem elem;              /* Element in a transaction. */
+    disk_sector_t sector;               /* Home sector. */
+    uint8_t data[DISK_SECTOR_SIZE];     /* Sector contents. */
+  };
+
+/* The running transaction, and the last committed transaction
+   if it has not been checkpointed yet, as sets of images.
+   JOURNAL_LOCK protects both sets and the images' data. */
+static struct hash transactions[2];
+static struct hash *running, *committed;
+static struct lock journal_lock;
+
+/* Room in the running transaction reserved by the operations in
+   progress, beyond the images they have added to it so far, and
+   a condition signaled whenever an operation ends and gives back
+   what it did not use.  Protected by JOURNAL_LOCK. */
+static size_t txn_reserved;
+static struct condition txn_room;
+
+/* Held for reading by each operation in progress, and for
+   writing by a commit, so that a transaction is only committed
+   between operations.  Commits are serialized by this lock, and
+   so are the members below. */
+static struct rwlock txn_rwlock;
+static uint32_t last_seq;               /* Last transaction committed. */
+static uint32_t checkpointed;           /* Last transaction written home. */
+static struct image *order[TXN_MAX];    /* A transaction, by sector. */
+static struct journal_header header;
+static struct journal_desc desc;
+static struct commit_record commit;
+
+static struct image *find_image (struct hash *, disk_sector_t);
+static struct image *new_image (disk_sector_t, bool need_data);
+static void drop_image (struct hash *, disk_sector_t);
+static size_t sort_images (struct hash *);
+static void write_header (void);
+static void write_log (void);
+static void checkpoint (void);
+static void recover (void);
+static hash_hash_func image_hash;
+static hash_less_func image_less;
+static hash_action_func image_free;
+
+/* Initializes the journal.  If FORMAT is true, writes an empty
+   journal to disk; otherwise, replays the committed transaction
+   left in the journal, if any. */
+void
+journal_init (bool format)
+{
+  ASSERT (sizeof header == DISK_SECTOR_SIZE);
+  ASSERT (sizeof desc == DISK_SECTOR_SIZE);
+  ASSERT (sizeof commit == DISK_SECTOR_SIZE);
+
+  if (disk_size (filesys_disk) < JOURNAL_START + JOURNAL_SECTORS)
+    PANIC ("disk too small for journal");
+  if (!hash_init (&transactions[0], image_hash, image_less, NULL)
+      || !hash_init (&transactions[1], image_hash, image_less, NULL))
+    PANIC ("journal initialization failed");
+  running = &transactions[0];
+  committed = &transactions[1];
+  lock_init (&journal_lock);
+  cond_init (&txn_room);
+  rwlock_init (&txn_rwlock);
+
+  if (format)
+    {
+      /* Make sure that no old transaction is left to replay. */
+      last_seq = checkpointed = 0;
+      write_header ();
+      memset (&desc, 0, sizeof desc);
+      disk_write (filesys_disk, LOG_START, &desc);
+    }
+  else
+    recover ();
+}
+
+/* Commits the running transaction and checkpoints it, leaving
+   nothing in the log to replay, and writes all the other dirty
+   cached sectors to disk. */
+void
+journal_done (void)
+{
+  journal_commit ();
+  rwlock_acquire_write (&txn_rwlock);
+  checkpoint ();
+  rwlock_release_write (&txn_rwlock);
+  cache_flush ();
+}
+
+/* Starts an operation that changes metadata, which becomes part
+   of the running transaction.  Operations may nest, in which
+   case only the outermost one counts.
+
+   The outermost operation first reserves room for OP_MAX sectors
+   in the running transaction.  If the other operations in
+   progress have reserved too much of it, this waits for one of
+   them to end; if the transaction itself is too full, this
+   commits it and starts over with an empty one. */
+void
+journal_begin (void)
+{
+  struct thread *t = thread_current ();
+
+  if (t->journal_depth++ > 0)
+    return;
+
+  lock_acquire (&journal_lock);
+  while (hash_size (running) + txn_reserved + OP_MAX > TXN_MAX)
+    if (hash_size (running) + OP_MAX <= TXN_MAX)
+      cond_wait (&txn_room, &journal_lock);
+    else
+      {
+        lock_release (&journal_lock);
+        journal_commit ();
+        lock_acquire (&journal_lock);
+      }
+  txn_reserved += OP_MAX;
+  t->journal_left = OP_MAX;
+  lock_release (&journal_lock);
+
+  rwlock_acquire_read (&txn_rwlock);
+}
+
+/* Ends an operation started with journal_begin().  If that was
+   the outermost operation and the running transaction has grown
+   large, commits it. */
+void
+journal_end (void)
+{
+  struct thread *t = thread_current ();
+  bool full;
+
+  ASSERT (t->journal_depth > 0);
+
+  if (--t->journal_depth > 0)
+    return;
+  rwlock_release_read (&txn_rwlock);
+
+  lock_acquire (&journal_lock);
+  txn_reserved -= t->journal_left;
+  t->journal_left = 0;
+  cond_broadcast (&txn_room, &journal_lock);
+  full = hash_size (running) >= TXN_COMMIT_CNT;
+  lock_release (&journal_lock);
+  if (full)
+    journal_commit ();
+}
+
+/* Copies SIZE bytes from BUFFER into metadata SECTOR, starting
+   at offset OFS within the sector, as part of the running
+   transaction.  Must be called within an operation. */
+void
+journal_write (disk_sector_t sector, const void *buffer, size_t ofs,
+               size_t size)
+{
+  struct image *image;
+
+  ASSERT (thread_current ()->journal_depth > 0);
+  ASSERT (ofs + size <= DISK_SECTOR_SIZE);
+
+  lock_acquire (&journal_lock);
+  image = find_image (running, sector);
+  lock_release (&journal_lock);
+  if (image == NULL)
+    image = new_image (sector, size < DISK_SECTOR_SIZE);
+
+  lock_acquire (&journal_lock);
+  memcpy (image->data + ofs, buffer, size);
+  lock_release (&journal_lock);
+  cache_write_logged (sector, buffer, ofs, size);
+}
+
+/* Forgets any changes to the CNT sectors starting at SECTOR,
+   which are being freed, so that they are not written over
+   whatever the sectors are reused for. */
+void
+journal_forget (disk_sector_t sector, size_t cnt)
+{
+  lock_acquire (&journal_lock);
+  for (; cnt > 0; sector++, cnt--)
+    {
+      drop_image (running, sector);
+      drop_image (committed, sector);
+    }
+  lock_release (&journal_lock);
+}
+
+/* Waits for the operations in progress to end, then checkpoints
+   the last committed transaction and commits the running one. */
+void
+journal_commit (void)
+{
+  rwlock_acquire_write (&txn_rwlock);
+  checkpoint ();
+  if (hash_size (running) > 0)
+    {
+      struct hash *done;
+
+      write_log ();
+      lock_acquire (&journal_lock);
+      done = committed;
+      committed = running;
+      running = done;
+      lock_release (&journal_lock);
+      free_map_commit ();
+    }
+  rwlock_release_write (&txn_rwlock);
+}
+
+/* If SECTOR has been changed by a transaction that has not been
+   checkpointed, copies its latest contents into BUFFER and
+   returns true.  Otherwise, returns false.  Used by the buffer
+   cache to reload logged sectors that it has evicted. */
+bool
+journal_read (disk_sector_t sector, void *buffer)
+{
+  struct image *image;
+
+  lock_acquire (&journal_lock);
+  image = find_image (running, sector);
+  if (image == NULL)
+    image = find_image (committed, sector);
+  if (image != NULL)
+    memcpy (buffer, image->data, DISK_SECTOR_SIZE);
+  lock_release (&journal_lock);
+  return image != NULL;
+}
+
+/* Returns the image of SECTOR in transaction TXN, or a null
+   pointer if there is none. */
+static struct image *
+find_image (struct hash *txn, disk_sector_t sector)
+{
+  struct image key;
+  struct hash_elem *e;
+
+  key.sector = sector;
+  e = hash_find (txn, &key.elem);
+  return e != NULL ? hash_entry (e, struct image, elem) : NULL;
+}
+
+/* Adds an image of SECTOR to the running transaction, if it
+   does not have one yet, and returns the image.  If NEED_DATA is
+   true, a new image starts out with SECTOR's current contents.
+   A new image uses up part of the current operation's
+   reservation. */
+static struct image *
+new_image (disk_sector_t sector, bool need_data)
+{
+  struct image *image, *old;
+
+  image = malloc (sizeof *image);
+  if (image == NULL)
+    PANIC ("out of memory for journal");
+  image->sector = sector;
+  if (need_data)
+    cache_read (sector, image->data, 0, DISK_SECTOR_SIZE);
+
+  lock_acquire (&journal_lock);
+  old = find_image (running, sector);
+  if (old == NULL)
+    {
+      struct thread *t = thread_current ();
+
+      if (t->journal_left > 0)
+        {
+          t->journal_left--;
+          txn_reserved--;
+        }
+      else if (hash_size (running) + txn_reserved >= TXN_MAX)
+        PANIC ("journal operation changed more than %d sectors", OP_MAX);
+      hash_insert (running, &image->elem);
+    }
+  lock_release (&journal_lock);
+
+  if (old != NULL)
+    {
+      free (image);
+      image = old;
+    }
+  return image;
+}
+
+/* Removes and frees the image of SECTOR in transaction TXN, if
+   any.  JOURNAL_LOCK must be held. */
+static void
+drop_image (struct hash *txn, disk_sector_t sector)
+{
+  struct image *image = find_image (txn, sector);
+
+  if (image != NULL)
+    {
+      hash_delete (txn, &image->elem);
+      free (image);
+    }
+}
+
+/* Stores the images in transaction TXN into ORDER[], sorted by
+   sector so that they are written in one sweep of the disk, and
+   returns how many there are. */
+static size_t
+sort_images (struct hash *txn)
+{
+  struct hash_iterator i;
+  size_t cnt = 0;
+
+  hash_first (&i, txn);
+  while (hash_next (&i))
+    {
+      struct image *image = hash_entry (hash_cur (&i), struct image, elem);
+      size_t j;
+
+      for (j = cnt++; j > 0 && order[j - 1]->sector > image->sector; j--)
+        order[j] = order[j - 1];
+      order[j] = image;
+    }
+  return cnt;
+}
+
+/* Writes the journal header, recording that every transaction
+   up to CHECKPOINTED has been written home. */
+static void
+write_header (void)
+{
+  memset (&header, 0, sizeof header);
+  header.magic = HEADER_MAGIC;
+  header.checkpointed = checkpointed;
+  disk_write (filesys_disk, JOURNAL_START, &header);
+}
+
+/* Writes the running transaction to the log as transaction
+   LAST_SEQ + 1.  The previous transaction must have been
+   checkpointed. */
+static void
+write_log (void)
+{
+  size_t cnt = sort_images (running);
+  size_t desc_cnt = DIV_ROUND_UP (cnt, DESC_SECTORS);
+  uint32_t seq = last_seq + 1;
+  size_t i;
+
+  ASSERT (checkpointed == last_seq);
+
+  for (i = 0; i < cnt; i++)
+    {
+      if (i % DESC_SECTORS == 0)
+        {
+          memset (&desc, 0, sizeof desc);
+          desc.magic = DESC_MAGIC;
+          desc.seq = seq;
+          desc.cnt = cnt;
+        }
+      desc.sectors[i % DESC_SECTORS] = order[i]->sector;
+      if ((i + 1) % DESC_SECTORS == 0 || i + 1 == cnt)
+        disk_write (filesys_disk, LOG_START + i / DESC_SECTORS, &desc);
+    }
+  for (i = 0; i < cnt; i++)
+    disk_write (filesys_disk, LOG_START + desc_cnt + i, order[i]->data);
+
+  memset (&commit, 0, sizeof commit);
+  commit.magic = COMMIT_MAGIC;
+  commit.seq = seq;
+  commit.cnt = cnt;
+  disk_write (filesys_disk, LOG_START + desc_cnt + cnt, &commit);
+  last_seq = seq;
+}
+
+/* Writes the images of the last committed transaction, if it
+   has not been checkpointed, to their home sectors and records
+   in the journal header that it need not be replayed, then
+   discards them.  Its images may all have been forgotten, but
+   the header must still be updated, because the next commit
+   reuses the log.  TXN_RWLOCK must be held for writing, so the
+   running transaction cannot change. */
+static void
+checkpoint (void)
+{
+  size_t cnt;
+  size_t i;
+
+  if (checkpointed == last_seq)
+    return;
+  cnt = sort_images (committed);
+  for (i = 0; i < cnt; i++)
+    disk_write (filesys_disk, order[i]->sector, order[i]->data);
+  checkpointed = last_seq;
+  write_header ();
+
+  /* The cached copies now match the disk, unless the running
+     transaction has changed them again. */
+  for (i = 0; i < cnt; i++)
+    if (find_image (running, order[i]->sector) == NULL)
+      cache_unlog (order[i]->sector);
+
+  lock_acquire (&journal_lock);
+  hash_clear (committed, image_free);
+  lock_release (&journal_lock);
+}
+
+/* Replays the transaction in the log if it was committed but
+   not checkpointed. */
+static void
+recover (void)
+{
+  static uint8_t data[DISK_SECTOR_SIZE];
+  size_t cnt, desc_cnt, i;
+  uint32_t seq;
+
+  disk_read (filesys_disk, JOURNAL_START, &header);
+  if (header.magic != HEADER_MAGIC)
+    PANIC ("file system has no journal (reformat it with -f)");
+  last_seq = checkpointed = header.checkpointed;
+
+  seq = last_seq + 1;
+  disk_read (filesys_disk, LOG_START, &desc);
+  if (desc.magic != DESC_MAGIC || desc.seq != seq
+      || desc.cnt == 0 || desc.cnt > TXN_MAX)
+    return;
+  cnt = desc.cnt;
+  desc_cnt = DIV_ROUND_UP (cnt, DESC_SECTORS);
+  disk_read (filesys_disk, LOG_START + desc_cnt + cnt, &commit);
+  if (commit.magic != COMMIT_MAGIC || commit.seq != seq || commit.cnt != cnt)
+    return;
+
+  printf ("Replaying journal: %zu sectors.\n", cnt);
+  for (i = 0; i < cnt; i++)
+    {
+      if (i % DESC_SECTORS == 0)
+        disk_read (filesys_disk, LOG_START + i / DESC_SECTORS, &desc);
+      disk_read (filesys_disk, LOG_START + desc_cnt + i, data);
+      disk_write (filesys_disk, desc.sectors[i % DESC_SECTORS], data);
+    }
+  last_seq = checkpointed = seq;
+  write_header ();
+}
+
+/* Returns a hash value for image I. */
+static unsigned
+image_hash (const struct hash_elem *i_, void *aux UNUSED)
+{
+  const struct image *i = hash_entry (i_, struct image, elem);
+  return hash_int (i->sector);
+}
+
+/* Returns true if image A precedes image B. */
+static bool
+image_less (const struct hash_elem *a_, const struct hash_elem *b_,
+            void *aux UNUSED)
+{
+  const struct image *a = hash_entry (a_, struct image, elem);
+  const struct image *b = hash_entry (b_, struct image, elem);
+
+  return a->sector < b->sector;
+}
+
+/* Frees image I. */
+static void
+image_free (struct hash_elem *i_, void *aux UNUSED)
+{
+  free (hash_entry (i_, struct image, elem));
+}
@@ -0,0 +1,25 @@
+#ifndef FILESYS_JOURNAL_H
+#define FILESYS_JOURNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "devices/disk.h"
+
+/* Sectors reserved for the journal, right after the system file
+   inodes. */
+#define JOURNAL_START 2         /* First journal sector. */
+#define JOURNAL_SECTORS 256     /* Number of journal sectors. */
+
+void journal_init (bool format);
+void journal_done (void);
+
+void journal_begin (void);
+void journal_end (void);
+void journal_write (disk_sector_t, const void *buffer, size_t ofs,
+                    size_t size);
+void journal_forget (disk_sector_t, size_t cnt);
+void journal_commit (void);
+
+bool journal_read (disk_sector_t, void *buffer);
+
+#endif /* filesys/journal.h */
@@ -0,0 +1,13 @@
+#ifndef __LIB_IOVEC_H
+#define __LIB_IOVEC_H
+
+#include <stddef.h>
+
+/* One of the buffers of a vectored read or write. */
+struct iovec
+  {
+    void *iov_base;             /* Start of buffer. */
+    size_t iov_len;             /* Length of buffer, in bytes. */
+  };
+
+#endif /* lib/iovec.h */
@@ -351,6 +351,33 @@ bitmap_read (struct bitmap *b, struct file *file)
   return success;
 }
 
+/* Reads the CNT bits in B starting at START from FILE, from
+   where bitmap_write() would have put them, leaving the rest of
+   B alone.  Bits that share an element with those bits are read
+   too.  Returns true if successful, false otherwise. */
+bool
+bitmap_read_range (struct bitmap *b, struct file *file,
+                   size_t start, size_t cnt)
+{
+  size_t first, last;
+  off_t size;
+  bool success;
+
+  ASSERT (start <= b->bit_cnt);
+  ASSERT (start + cnt <= b->bit_cnt);
+
+  if (cnt == 0)
+    return true;
+  first = elem_idx (start);
+  last = elem_idx (start + cnt - 1);
+  size = (last - first + 1) * sizeof (elem_type);
+  success = (file_read_at (file, b->bits + first, size,
+                           first * sizeof (elem_type)) == size);
+  if (last == elem_cnt (b->bit_cnt) - 1)
+    b->bits[last] &= last_mask (b);
+  return success;
+}
+
 /* Writes B to FILE.  Return true if successful, false
    otherwise. */
 bool
@@ -359,6 +386,28 @@ bitmap_write (const struct bitmap *b, struct file *file)
   off_t size = byte_cnt (b->bit_cnt);
   return file_write_at (file, b->bits, size, 0) == size;
 }
+
+/* Writes the CNT bits in B starting at START to FILE, where
+   bitmap_write() would put them, leaving the rest of FILE
+   alone.  Return true if successful, false otherwise. */
+bool
+bitmap_write_range (const struct bitmap *b, struct file *file,
+                    size_t start, size_t cnt)
+{
+  size_t first, last;
+  off_t size;
+
+  ASSERT (start <= b->bit_cnt);
+  ASSERT (start + cnt <= b->bit_cnt);
+
+  if (cnt == 0)
+    return true;
+  first = elem_idx (start);
+  last = elem_idx (start + cnt - 1);
+  size = (last - first + 1) * sizeof (elem_type);
+  return (file_write_at (file, b->bits + first, size,
+                         first * sizeof (elem_type)) == size);
+}
 #endif /* FILESYS */
 
 /* Debugging. */
@@ -0,0 +1,50 @@
+/* Grows a file to exactly 492 bytes, the most that a file can
+   keep inline in its inode, with a single write, and then by one
+   more byte, which moves its data out to a data sector.  Checks
+   the file's size after each write and its contents both before
+   and after the move. */
+
+#include <random.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define INLINE_MAX 492
+
+static char buf[INLINE_MAX + 1];
+
+/* Writes the SIZE bytes of BUF at offset OFS to FD, which is
+   positioned there, and checks that the file grew to match. */
+static void
+write_and_check (int fd, size_t ofs, size_t size) 
+{
+  long actual;
+
+  if (write (fd, buf + ofs, size) != (int) size)
+    fail ("write %zu bytes at offset %zu in \"testfile\" failed",
+          size, ofs);
+  actual = filesize (fd);
+  if (actual != (long) (ofs + size))
+    fail ("filesize not updated properly: should be %zu, actually %ld",
+          ofs + size, actual);
+}
+
+void
+test_main (void) 
+{
+  int fd;
+
+  random_bytes (buf, sizeof buf);
+  CHECK (create ("testfile", 0), "create \"testfile\"");
+  CHECK ((fd = open ("testfile")) > 1, "open \"testfile\"");
+
+  msg ("write %d bytes", INLINE_MAX);
+  write_and_check (fd, 0, INLINE_MAX);
+  check_file ("testfile", buf, INLINE_MAX);
+
+  msg ("write 1 more byte");
+  write_and_check (fd, INLINE_MAX, 1);
+  msg ("close \"testfile\"");
+  close (fd);
+  check_file ("testfile", buf, sizeof buf);
+}
@@ -0,0 +1,20 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(grow-inline) begin
+(grow-inline) create "testfile"
+(grow-inline) open "testfile"
+(grow-inline) write 492 bytes
+(grow-inline) open "testfile" for verification
+(grow-inline) verified contents of "testfile"
+(grow-inline) close "testfile"
+(grow-inline) write 1 more byte
+(grow-inline) close "testfile"
+(grow-inline) open "testfile" for verification
+(grow-inline) verified contents of "testfile"
+(grow-inline) close "testfile"
+(grow-inline) end
+EOF
+pass;
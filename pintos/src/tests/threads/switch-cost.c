@@ -0,0 +1,91 @@
+/* Measures what an address space switch costs the kernel.
+
+   Two threads hand a semaphore back and forth ROUNDS times.
+   Before each hand-off, the running thread reloads CR3, as
+   pagedir_activate() does on every process switch, and then
+   reads one word from each of PAGE_CNT kernel pages, which needs
+   their TLB entries.  With global kernel pages, the default, the
+   reload leaves those entries in the TLB; with -nopge it drops
+   them, and every round must refill them.  Run the test both
+   ways and compare the CPU cycles per round that it reports.
+
+   Any number of cycles passes: the test only checks that the
+   rounds all complete. */
+
+#include <stdio.h>
+#include "tests/threads/tests.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+
+#define ROUNDS 10000
+#define PAGE_CNT 32
+
+static struct semaphore ping, pong;
+static uint8_t *pages;
+
+static thread_func pong_thread;
+static void switch_and_touch (void);
+static uint64_t read_tsc (void);
+
+void
+test_switch_cost (void)
+{
+  uint64_t start, cycles;
+  int i;
+
+  pages = palloc_get_multiple (PAL_ASSERT, PAGE_CNT);
+  sema_init (&ping, 0);
+  sema_init (&pong, 0);
+  thread_create ("pong", PRI_DEFAULT, pong_thread, NULL);
+
+  start = read_tsc ();
+  for (i = 0; i < ROUNDS; i++)
+    {
+      switch_and_touch ();
+      sema_up (&ping);
+      sema_down (&pong);
+    }
+  cycles = read_tsc () - start;
+
+  msg ("%d rounds, %llu cycles per round",
+       ROUNDS, (unsigned long long) (cycles / ROUNDS));
+  palloc_free_multiple (pages, PAGE_CNT);
+}
+
+/* The other half of each round. */
+static void
+pong_thread (void *aux UNUSED)
+{
+  int i;
+
+  for (i = 0; i < ROUNDS; i++)
+    {
+      sema_down (&ping);
+      switch_and_touch ();
+      sema_up (&pong);
+    }
+}
+
+/* Reloads CR3, which drops every TLB entry that is not global,
+   then reads a word from each of the PAGE_CNT pages. */
+static void
+switch_and_touch (void)
+{
+  uint32_t cr3;
+  int i;
+
+  asm volatile ("movl %%cr3, %0; movl %0, %%cr3" : "=r" (cr3) : : "memory");
+  for (i = 0; i < PAGE_CNT; i++)
+    (void) *(volatile uint32_t *) (pages + i * PGSIZE);
+}
+
+/* Returns the CPU's time-stamp counter. */
+static uint64_t
+read_tsc (void)
+{
+  uint64_t tsc;
+  asm volatile ("rdtsc" : "=A" (tsc));
+  return tsc;
+}
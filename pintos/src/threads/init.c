@@ -29,10 +29,16 @@
 #else
 #include "tests/threads/tests.h"
 #endif
+#ifdef VM
+#include "vm/page.h"
+#endif
 #ifdef FILESYS
 #include "devices/disk.h"
+#include "filesys/cache.h"
+#include "filesys/dcache.h"
 #include "filesys/filesys.h"
 #include "filesys/fsutil.h"
+#include "filesys/inode.h"
 #endif
 
 /* Amount of physical memory, in 4 kB pages. */
@@ -49,8 +55,16 @@ static bool format_filesys;
 /* -q: Power off after kernel tasks complete? */
 bool power_off_when_done;
 
+/* -nopge: Leave global pages disabled, even if the CPU has them? */
+static bool no_pge;
+
+/* Global page support.  See [IA32-v3a] 2.5 "Control Registers". */
+#define CR4_PGE 0x00000080      /* Page Global Enable. */
+#define CPUID_PGE 0x00002000    /* CPUID 1 EDX: PGE supported. */
+
 static void ram_init (void);
 static void paging_init (void);
+static bool cpu_has_pge (void);
 
 static char **read_command_line (void);
 static char **parse_options (char **argv);
@@ -87,6 +101,9 @@ main (void)
   palloc_init ();
   malloc_init ();
   paging_init ();
+#ifdef VM
+  page_init ();
+#endif
 
   /* Segmentation. */
 #ifdef USERPROG
@@ -184,6 +201,27 @@ paging_init (void)
      to/from Control Registers" and [IA32-v3a] 3.7.5 "Base Address
      of the Page Directory". */
   asm volatile ("movl %0, %%cr3" : : "r" (vtop (base_page_dir)));
+
+  /* Enable global pages, so that the kernel mappings created
+     above (which pte_create_kernel() marks PTE_G) survive the
+     CR3 reload in pagedir_activate() on every process switch.
+     PGE is reported by CPUID function 1 in EDX bit 13.  See
+     [IA32-v3a] 2.5 "Control Registers". */
+  if (!no_pge && cpu_has_pge ())
+    {
+      uint32_t cr4;
+      asm volatile ("movl %%cr4, %0" : "=r" (cr4));
+      asm volatile ("movl %0, %%cr4" : : "r" (cr4 | CR4_PGE) : "memory");
+    }
+}
+
+/* Returns true if the CPU supports global pages. */
+static bool
+cpu_has_pge (void)
+{
+  uint32_t eax = 1, ebx, ecx, edx;
+  asm ("cpuid" : "+a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx));
+  return (edx & CPUID_PGE) != 0;
 }
 
 /* Breaks the kernel command line into words and returns them as
@@ -239,11 +277,17 @@ parse_options (char **argv)
 #ifdef FILESYS
       else if (!strcmp (name, "-f"))
         format_filesys = true;
+      else if (!strcmp (name, "-flush"))
+        cache_flush_interval = atoi (value);
+      else if (!strcmp (name, "-indexed"))
+        inode_indexed = true;
 #endif
       else if (!strcmp (name, "-rs"))
         random_init (atoi (value));
       else if (!strcmp (name, "-mlfqs"))
         thread_mlfqs = true;
+      else if (!strcmp (name, "-nopge"))
+        no_pge = true;
 #ifdef USERPROG
       else if (!strcmp (name, "-ul"))
         user_page_limit = atoi (value);
@@ -347,8 +391,15 @@ usage (void)
           "  -h                 Print this help message and power off.\n"
           "  -q                 Power off VM after actions or on panic.\n"
           "  -f                 Format file system disk during startup.\n"
+#ifdef FILESYS
+          "  -flush=TICKS       Flush dirty cached sectors every TICKS\n"
+          "                     timer ticks (0 to disable).\n"
+          "  -indexed           Index new files' data with sector\n"
+          "                     pointers instead of extents.\n"
+#endif
           "  -rs=SEED           Set random number seed to SEED.\n"
           "  -mlfqs             Use multi-level feedback queue scheduler.\n"
+          "  -nopge             Don't use global pages for kernel mappings.\n"
 #ifdef USERPROG
           "  -ul=COUNT          Limit user memory to COUNT pages.\n"
 #endif
@@ -389,6 +440,8 @@ print_stats (void)
   thread_print_stats ();
 #ifdef FILESYS
   disk_print_stats ();
+  cache_print_stats ();
+  dcache_print_stats ();
 #endif
   console_print_stats ();
   kbd_print_stats ();
@@ -66,6 +66,7 @@ static inline uintptr_t pd_no (const void *va) {
 #define PTE_U 0x4               /* 1=user/kernel, 0=kernel only. */
 #define PTE_A 0x20              /* 1=accessed, 0=not acccessed. */
 #define PTE_D 0x40              /* 1=dirty, 0=not dirty (PTEs only). */
+#define PTE_G 0x100             /* 1=global, 0=per-process (PTEs only). */
 
 /* Returns a PDE that points to page table PT. */
 static inline uint32_t pde_create (uint32_t *pt) {
@@ -83,18 +84,26 @@ static inline uint32_t *pde_get_pt (uint32_t pde) {
 /* Returns a PTE that points to PAGE.
    The PTE's page is readable.
    If WRITABLE is true then it will be writable as well.
-   The page will be usable only by ring 0 code (the kernel). */
+   The page will be usable only by ring 0 code (the kernel).
+
+   Kernel mappings are identical in every page directory, so the
+   PTE is marked global: once the CPU has PGE enabled (see
+   paging_init()), reloading CR3 on a process switch leaves its
+   TLB entries alone.  See [IA32-v3a] 3.12 "Translation Lookaside
+   Buffers (TLBs)". */
 static inline uint32_t pte_create_kernel (void *page, bool writable) {
   ASSERT (pg_ofs (page) == 0);
-  return vtop (page) | PTE_P | (writable ? PTE_W : 0);
+  return vtop (page) | PTE_P | PTE_G | (writable ? PTE_W : 0);
 }
 
 /* Returns a PTE that points to PAGE.
    The PTE's page is readable.
    If WRITABLE is true then it will be writable as well.
-   The page will be usable by both user and kernel code. */
+   The page will be usable by both user and kernel code.
+   User mappings differ from process to process, so they are
+   never global. */
 static inline uint32_t pte_create_user (void *page, bool writable) {
-  return pte_create_kernel (page, writable) | PTE_U;
+  return (pte_create_kernel (page, writable) & ~PTE_G) | PTE_U;
 }
 
 /* Returns a pointer to the page that page table entry PTE points
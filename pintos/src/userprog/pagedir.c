@@ -7,7 +7,18 @@
 #include "threads/palloc.h"
 
 static uint32_t *active_pd (void);
-static void invalidate_pagedir (uint32_t *);
+static void invalidate_page (uint32_t *, const void *);
+static void invlpg (const void *);
+static bool clear_page (uint32_t *, void *);
+static bool set_flag (uint32_t *, const void *, uint32_t flag, bool value);
+static void batch_add (struct pagedir_batch *, const void *);
+
+/* Called by walk_ptes() for each present PTE. */
+typedef void pte_visit_func (uint32_t *pte, void *upage, void *aux);
+static void walk_ptes (uint32_t *pd, void *start, void *end,
+                       pte_visit_func *, void *aux);
+static pte_visit_func visit_present;
+static pte_visit_func visit_accessed;
 
 /* Creates a new page directory that has mappings for kernel
    virtual addresses, but none for user virtual addresses.
@@ -145,17 +156,8 @@ pagedir_get_page (uint32_t *pd, const void *uaddr)
 void
 pagedir_clear_page (uint32_t *pd, void *upage) 
 {
-  uint32_t *pte;
-
-  ASSERT (pg_ofs (upage) == 0);
-  ASSERT (is_user_vaddr (upage));
-
-  pte = lookup_page (pd, upage, false);
-  if (pte != NULL && (*pte & PTE_P) != 0)
-    {
-      *pte &= ~PTE_P;
-      invalidate_pagedir (pd);
-    }
+  if (clear_page (pd, upage))
+    invalidate_page (pd, upage);
 }
 
 /* Returns true if the PTE for virtual page VPAGE in PD is dirty,
@@ -174,17 +176,8 @@ pagedir_is_dirty (uint32_t *pd, const void *vpage)
 void
 pagedir_set_dirty (uint32_t *pd, const void *vpage, bool dirty) 
 {
-  uint32_t *pte = lookup_page (pd, vpage, false);
-  if (pte != NULL) 
-    {
-      if (dirty)
-        *pte |= PTE_D;
-      else 
-        {
-          *pte &= ~(uint32_t) PTE_D;
-          invalidate_pagedir (pd);
-        }
-    }
+  if (set_flag (pd, vpage, PTE_D, dirty))
+    invalidate_page (pd, vpage);
 }
 
 /* Returns true if the PTE for virtual page VPAGE in PD has been
@@ -202,18 +195,264 @@ pagedir_is_accessed (uint32_t *pd, const void *vpage)
    VPAGE in PD. */
 void
 pagedir_set_accessed (uint32_t *pd, const void *vpage, bool accessed) 
+{
+  if (set_flag (pd, vpage, PTE_A, accessed))
+    invalidate_page (pd, vpage);
+}
+
+/* Auxiliary data for visit_present(). */
+struct present_aux
+  {
+    pagedir_page_func *func;            /* Caller's function. */
+    void *aux;                          /* Caller's auxiliary data. */
+  };
+
+/* Auxiliary data for visit_accessed(). */
+struct accessed_aux
+  {
+    struct pagedir_batch batch;         /* Pending invalidations. */
+    pagedir_page_func *func;            /* Caller's function. */
+    void *aux;                          /* Caller's auxiliary data. */
+    size_t cnt;                         /* Accessed pages so far. */
+  };
+
+/* Calls FUNC for each present page in PD between user virtual
+   addresses START (inclusive) and END (exclusive), in ascending
+   order, passing the page's user address, the kernel virtual
+   address of its frame, and AUX.
+
+   Unlike calling pagedir_get_page() once per address, this walks
+   each page table linearly and consults the page directory only
+   once per 4 MB region, skipping regions without a page table
+   entirely, so the cost is proportional to the mapped pages.
+   FUNC must not add or remove mappings in PD. */
+void
+pagedir_for_each_present (uint32_t *pd, void *start, void *end,
+                          pagedir_page_func *func, void *aux) 
+{
+  struct present_aux present;
+
+  present.func = func;
+  present.aux = aux;
+  walk_ptes (pd, start, end, visit_present, &present);
+}
+
+/* Scans the present pages in PD between START (inclusive) and
+   END (exclusive), as pagedir_for_each_present() does.  For each
+   page whose accessed bit is set, clears the bit and, if FUNC is
+   non-null, calls FUNC with the page's user address, the kernel
+   virtual address of its frame, and AUX.  Returns the number of
+   accessed pages found.
+
+   This is one sweep of the "clock" (second chance) replacement
+   algorithm: pages not reported here have not been touched
+   since the previous sweep.  The TLB invalidations needed for
+   the cleared bits are batched and issued before returning. */
+size_t
+pagedir_scan_accessed (uint32_t *pd, void *start, void *end,
+                       pagedir_page_func *func, void *aux) 
+{
+  struct accessed_aux accessed;
+
+  pagedir_batch_init (&accessed.batch, pd);
+  accessed.func = func;
+  accessed.aux = aux;
+  accessed.cnt = 0;
+  walk_ptes (pd, start, end, visit_accessed, &accessed);
+  pagedir_batch_flush (&accessed.batch);
+
+  return accessed.cnt;
+}
+
+/* walk_ptes() helper for pagedir_for_each_present(). */
+static void
+visit_present (uint32_t *pte, void *upage, void *present_)
+{
+  struct present_aux *present = present_;
+
+  present->func (upage, pte_get_page (*pte), present->aux);
+}
+
+/* walk_ptes() helper for pagedir_scan_accessed(). */
+static void
+visit_accessed (uint32_t *pte, void *upage, void *accessed_)
+{
+  struct accessed_aux *accessed = accessed_;
+
+  if ((*pte & PTE_A) != 0) 
+    {
+      *pte &= ~(uint32_t) PTE_A;
+      batch_add (&accessed->batch, upage);
+      accessed->cnt++;
+      if (accessed->func != NULL)
+        accessed->func (upage, pte_get_page (*pte), accessed->aux);
+    }
+}
+
+/* Calls VISIT for each present PTE in PD that maps a user page
+   between START (inclusive) and END (exclusive), passing the PTE,
+   the page's user virtual address, and AUX.  Each PDE is read
+   only once. */
+static void
+walk_ptes (uint32_t *pd, void *start, void *end,
+           pte_visit_func *visit, void *aux) 
+{
+  uintptr_t first = pg_no (start);
+  uintptr_t last = pg_no (pg_round_up (end));
+  uintptr_t page;
+
+  ASSERT (pd != NULL);
+  ASSERT (start <= end);
+  ASSERT (end <= PHYS_BASE);
+
+  for (page = first; page < last; )
+    {
+      uint8_t *upage = (uint8_t *) (page << PGBITS);
+      uint32_t pde = pd[pd_no (upage)];
+
+      /* Index of the first page past this page table's span. */
+      uintptr_t pt_end = (page | ((1 << PTBITS) - 1)) + 1;
+      if (pt_end > last)
+        pt_end = last;
+
+      if ((pde & PTE_P) != 0) 
+        {
+          uint32_t *pt = pde_get_pt (pde);
+
+          for (; page < pt_end; page++, upage += PGSIZE)
+            if ((pt[pt_no (upage)] & PTE_P) != 0)
+              visit (&pt[pt_no (upage)], upage, aux);
+        }
+      else
+        page = pt_end;
+    }
+}
+
+/* Batched versions of the functions above.
+
+   Eviction and unmapping change many pages of one page directory
+   in a row.  Invalidating the TLB after each change is wasteful,
+   so these functions only record which pages need it and
+   pagedir_batch_flush() invalidates them all at once: page by
+   page with INVLPG if there are few of them, or by reloading CR3
+   once if there are more than PAGEDIR_BATCH_MAX.
+
+   Until pagedir_batch_flush() is called the CPU may still use
+   stale TLB entries for the changed pages, so the caller must
+   flush before relying on the change, e.g. before freeing a
+   cleared page's frame. */
+
+/* Initializes BATCH to collect TLB invalidations for PD. */
+void
+pagedir_batch_init (struct pagedir_batch *batch, uint32_t *pd) 
+{
+  ASSERT (pd != NULL);
+
+  batch->pd = pd;
+  batch->page_cnt = 0;
+}
+
+/* Like pagedir_clear_page(), but defers TLB invalidation to
+   pagedir_batch_flush(). */
+void
+pagedir_batch_clear_page (struct pagedir_batch *batch, void *upage) 
+{
+  if (clear_page (batch->pd, upage))
+    batch_add (batch, upage);
+}
+
+/* Like pagedir_set_dirty(), but defers TLB invalidation to
+   pagedir_batch_flush(). */
+void
+pagedir_batch_set_dirty (struct pagedir_batch *batch, const void *vpage,
+                         bool dirty) 
+{
+  if (set_flag (batch->pd, vpage, PTE_D, dirty))
+    batch_add (batch, vpage);
+}
+
+/* Like pagedir_set_accessed(), but defers TLB invalidation to
+   pagedir_batch_flush(). */
+void
+pagedir_batch_set_accessed (struct pagedir_batch *batch, const void *vpage,
+                            bool accessed) 
+{
+  if (set_flag (batch->pd, vpage, PTE_A, accessed))
+    batch_add (batch, vpage);
+}
+
+/* Invalidates the TLB entries for every page recorded in BATCH
+   and empties BATCH, which may then be reused. */
+void
+pagedir_batch_flush (struct pagedir_batch *batch) 
+{
+  if (batch->page_cnt > 0 && active_pd () == batch->pd) 
+    {
+      if (batch->page_cnt <= PAGEDIR_BATCH_MAX) 
+        {
+          size_t i;
+
+          for (i = 0; i < batch->page_cnt; i++)
+            invlpg (batch->pages[i]);
+        }
+      else 
+        pagedir_activate (batch->pd);
+    }
+  batch->page_cnt = 0;
+}
+
+/* Records that VPAGE needs to be invalidated in BATCH.  Beyond
+   PAGEDIR_BATCH_MAX pages we only count, since the whole TLB
+   will be flushed anyway. */
+static void
+batch_add (struct pagedir_batch *batch, const void *vpage) 
+{
+  if (batch->page_cnt < PAGEDIR_BATCH_MAX)
+    batch->pages[batch->page_cnt] = vpage;
+  batch->page_cnt++;
+}
+
+/* Marks UPAGE not present in PD.
+   Returns true if a present mapping changed, in which case its
+   TLB entry must be invalidated. */
+static bool
+clear_page (uint32_t *pd, void *upage) 
+{
+  uint32_t *pte;
+
+  ASSERT (pg_ofs (upage) == 0);
+  ASSERT (is_user_vaddr (upage));
+
+  pte = lookup_page (pd, upage, false);
+  if (pte != NULL && (*pte & PTE_P) != 0)
+    {
+      *pte &= ~PTE_P;
+      return true;
+    }
+  return false;
+}
+
+/* Sets FLAG (PTE_A or PTE_D) in the PTE for VPAGE in PD if VALUE
+   is true, clears it otherwise.
+   Returns true if a flag was cleared, in which case the TLB entry
+   must be invalidated so that the CPU sets it again on the next
+   access.  (Setting a flag needs no invalidation: at worst the
+   CPU sets it again itself.) */
+static bool
+set_flag (uint32_t *pd, const void *vpage, uint32_t flag, bool value) 
 {
   uint32_t *pte = lookup_page (pd, vpage, false);
   if (pte != NULL) 
     {
-      if (accessed)
-        *pte |= PTE_A;
+      if (value)
+        *pte |= flag;
       else 
         {
-          *pte &= ~(uint32_t) PTE_A; 
-          invalidate_pagedir (pd);
+          *pte &= ~flag;
+          return true;
         }
     }
+  return false;
 }
 
 /* Loads page directory PD into the CPU's page directory base
@@ -228,7 +467,11 @@ pagedir_activate (uint32_t *pd)
      aka PDBR (page directory base register).  This activates our
      new page tables immediately.  See [IA32-v2a] "MOV--Move
      to/from Control Registers" and [IA32-v3a] 3.7.5 "Base
-     Address of the Page Directory". */
+     Address of the Page Directory".
+
+     Loading CR3 flushes only the non-global TLB entries, that is,
+     the user mappings; kernel mappings are global (see
+     pte_create_kernel()) and stay cached across the switch. */
   asm volatile ("movl %0, %%cr3" : : "r" (vtop (pd)) : "memory");
 }
 
@@ -245,21 +488,27 @@ active_pd (void)
   return ptov (pd);
 }
 
-/* Seom page table changes can cause the CPU's translation
+/* Some page table changes can cause the CPU's translation
    lookaside buffer (TLB) to become out-of-sync with the page
-   table.  When this happens, we have to "invalidate" the TLB by
-   re-activating it.
+   table.  When this happens, we have to "invalidate" the stale
+   TLB entry.
 
-   This function invalidates the TLB if PD is the active page
-   directory.  (If PD is not active then its entries are not in
-   the TLB, so there is no need to invalidate anything.) */
+   This function invalidates the TLB entry for VPAGE if PD is the
+   active page directory.  (If PD is not active then its entries
+   are not in the TLB, so there is no need to invalidate
+   anything.)  Unlike re-activating PD, which flushes every user
+   mapping, this drops only the single entry that changed. */
 static void
-invalidate_pagedir (uint32_t *pd) 
+invalidate_page (uint32_t *pd, const void *vpage) 
 {
   if (active_pd () == pd) 
-    {
-      /* Re-activating PD clears the TLB.  See [IA32-v3a] 3.12
-         "Translation Lookaside Buffers (TLBs)". */
-      pagedir_activate (pd);
-    } 
+    invlpg (vpage);
+}
+
+/* Invalidates the TLB entry for VPAGE in the active page
+   directory.  See [IA32-v2a] "INVLPG--Invalidate TLB Entry". */
+static void
+invlpg (const void *vpage) 
+{
+  asm volatile ("invlpg (%0)" : : "r" (vpage) : "memory");
 }
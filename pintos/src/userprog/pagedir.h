@@ -2,8 +2,22 @@
 #define USERPROG_PAGEDIR_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
+/* Beyond this many pages, pagedir_batch_flush() flushes the
+   whole TLB instead of invalidating page by page. */
+#define PAGEDIR_BATCH_MAX 32
+
+/* A batch of deferred TLB invalidations for one page directory.
+   See pagedir_batch_init() in pagedir.c. */
+struct pagedir_batch
+  {
+    uint32_t *pd;                       /* Page directory. */
+    size_t page_cnt;                    /* Number of pages changed. */
+    const void *pages[PAGEDIR_BATCH_MAX]; /* First pages changed. */
+  };
+
 uint32_t *pagedir_create (void);
 void pagedir_destroy (uint32_t *pd);
 bool pagedir_set_page (uint32_t *pd, void *upage, void *kpage, bool rw);
@@ -15,4 +29,20 @@ bool pagedir_is_accessed (uint32_t *pd, const void *upage);
 void pagedir_set_accessed (uint32_t *pd, const void *upage, bool accessed);
 void pagedir_activate (uint32_t *pd);
 
+/* Called by pagedir_for_each_present() and
+   pagedir_scan_accessed() for each page they visit. */
+typedef void pagedir_page_func (void *upage, void *kpage, void *aux);
+void pagedir_for_each_present (uint32_t *pd, void *start, void *end,
+                               pagedir_page_func *, void *aux);
+size_t pagedir_scan_accessed (uint32_t *pd, void *start, void *end,
+                              pagedir_page_func *, void *aux);
+
+void pagedir_batch_init (struct pagedir_batch *, uint32_t *pd);
+void pagedir_batch_clear_page (struct pagedir_batch *, void *upage);
+void pagedir_batch_set_dirty (struct pagedir_batch *, const void *upage,
+                              bool dirty);
+void pagedir_batch_set_accessed (struct pagedir_batch *, const void *upage,
+                                 bool accessed);
+void pagedir_batch_flush (struct pagedir_batch *);
+
 #endif /* userprog/pagedir.h */
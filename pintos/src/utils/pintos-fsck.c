@@ -0,0 +1,911 @@
+/* pintos-fsck: checks a Pintos file system disk (hd0:1) offline
+   and, optionally, rebuilds its free map.
+
+   The disk image is mapped into memory.  Unless repairing, it is
+   mapped privately, so that replaying the journal and the rest
+   of the work never reach the file.  Each sector is looked at a
+   bounded number of times, so the whole check takes time linear
+   in the size of the disk.
+
+   The on-disk structures below must match filesys/inode.c,
+   filesys/directory.c, filesys/journal.c and filesys/free-map.c. */
+
+#define _GNU_SOURCE 1
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SECTOR_SIZE 512
+
+/* Fixed sectors. */
+#define FREE_MAP_SECTOR 0               /* Free map file inode. */
+#define ROOT_DIR_SECTOR 1               /* Root directory inode. */
+#define JOURNAL_START 2                 /* Journal header. */
+#define JOURNAL_SECTORS 256             /* Sectors in the journal. */
+#define LOG_START (JOURNAL_START + 1)    /* Journal log. */
+#define SUPER_SECTOR (JOURNAL_START + JOURNAL_SECTORS) /* Superblock. */
+
+/* Magic numbers. */
+#define INODE_MAGIC 0x494e4f44
+#define DIR_MAGIC 0x48444952
+#define HEADER_MAGIC 0x4a524e4c
+#define DESC_MAGIC 0x44455343
+#define COMMIT_MAGIC 0x434d4954
+#define SUPER_MAGIC 0x53555042
+
+/* Inodes. */
+struct extent
+  {
+    uint32_t offset;                    /* First file sector. */
+    uint32_t start;                     /* First disk sector. */
+    uint32_t length;                    /* Number of sectors. */
+  };
+
+#define INODE_EXTENT_CNT 41
+#define BLOCK_EXTENT_CNT 42
+#define INLINE_MAX (INODE_EXTENT_CNT * sizeof (struct extent))
+#define DIRECT_CNT 121
+#define PTRS_PER_SECTOR (SECTOR_SIZE / sizeof (uint32_t))
+
+enum inode_layout
+  {
+    LAYOUT_EXTENTS,                     /* Extents. */
+    LAYOUT_INLINE,                      /* In the inode itself. */
+    LAYOUT_INDEXED                      /* Sector pointers. */
+  };
+
+struct inode_disk
+  {
+    int32_t length;                     /* File size in bytes. */
+    uint32_t magic;                     /* INODE_MAGIC. */
+    uint32_t extent_cnt;                /* Total number of extents. */
+    uint32_t overflow;                  /* First overflow block, or 0. */
+    union
+      {
+        struct extent extents[INODE_EXTENT_CNT];
+        uint8_t inline_data[INLINE_MAX];
+        struct
+          {
+            uint32_t direct[DIRECT_CNT];
+            uint32_t indirect;
+            uint32_t doubly_indirect;
+          };
+      };
+    uint32_t layout;                    /* One of LAYOUT_*. */
+  };
+
+struct extent_block
+  {
+    uint32_t next;                      /* Next overflow block, or 0. */
+    uint32_t unused;
+    struct extent extents[BLOCK_EXTENT_CNT];
+  };
+
+/* Directories. */
+#define NAME_MAX 14
+
+struct dir_entry
+  {
+    uint32_t inode_sector;              /* Inode, or 0 if never used. */
+    char name[NAME_MAX + 1];            /* Null terminated file name. */
+    uint8_t in_use;                     /* In use or free? */
+  };
+
+#define ENTRIES_PER_BUCKET (SECTOR_SIZE / sizeof (struct dir_entry))
+
+struct dir_header
+  {
+    uint32_t magic;                     /* DIR_MAGIC. */
+    uint32_t bucket_cnt;                /* Number of buckets. */
+    uint32_t entry_cnt;                 /* Entries in use. */
+    uint32_t used_cnt;                  /* Entries in use or removed. */
+  };
+
+/* Journal. */
+#define DESC_SECTORS 125
+#define TXN_MAX 250
+
+struct journal_header
+  {
+    uint32_t magic;                     /* HEADER_MAGIC. */
+    uint32_t checkpointed;              /* Last transaction written home. */
+  };
+
+struct journal_desc
+  {
+    uint32_t magic;                     /* DESC_MAGIC. */
+    uint32_t seq;                       /* Transaction sequence number. */
+    uint32_t cnt;                       /* Sectors in the transaction. */
+    uint32_t sectors[DESC_SECTORS];     /* Home sectors of images. */
+  };
+
+struct commit_record
+  {
+    uint32_t magic;                     /* COMMIT_MAGIC. */
+    uint32_t seq;                       /* Transaction sequence number. */
+    uint32_t cnt;                       /* Sectors in the transaction. */
+  };
+
+/* Superblock. */
+struct superblock
+  {
+    uint32_t magic;                     /* SUPER_MAGIC. */
+    uint32_t sector_cnt;                /* Sectors in the file system. */
+    uint32_t free_cnt;                  /* Free sectors, if CLEAN. */
+    uint32_t clean;                     /* Unmounted cleanly? */
+  };
+
+/* The disk. */
+static const char *disk_name;
+static uint8_t *disk;
+static uint32_t sector_cnt;
+
+/* What each sector is used for: the inode sector of the file
+   that owns it, one of the OWNER_* values, or NO_OWNER. */
+static uint32_t *owner;
+#define NO_OWNER UINT32_MAX
+#define OWNER_JOURNAL (UINT32_MAX - 1)
+#define OWNER_SUPER (UINT32_MAX - 2)
+
+/* Problems found, and those of them that a repair fixes. */
+static unsigned long problem_cnt, fixable_cnt;
+
+/* Statistics. */
+static unsigned long inode_cnt;
+
+static void
+fail_io (const char *msg, ...)
+     __attribute__ ((noreturn))
+     __attribute__ ((format (printf, 1, 2)));
+static void
+problem (bool fixable, const char *msg, ...)
+     __attribute__ ((format (printf, 2, 3)));
+static void usage (int exit_code) __attribute__ ((noreturn));
+
+/* Prints MSG, formatting as with printf(),
+   plus an error message based on errno,
+   and exits with status 8. */
+static void
+fail_io (const char *msg, ...)
+{
+  va_list args;
+
+  fprintf (stderr, "pintos-fsck: ");
+  va_start (args, msg);
+  vfprintf (stderr, msg, args);
+  va_end (args);
+
+  if (errno != 0)
+    fprintf (stderr, ": %s", strerror (errno));
+  putc ('\n', stderr);
+  exit (8);
+}
+
+/* Reports a problem with the file system, described by MSG,
+   formatted as with printf().  FIXABLE is true if a repair
+   fixes it. */
+static void
+problem (bool fixable, const char *msg, ...)
+{
+  va_list args;
+
+  va_start (args, msg);
+  vprintf (msg, args);
+  va_end (args);
+  putchar ('\n');
+
+  problem_cnt++;
+  if (fixable)
+    fixable_cnt++;
+}
+
+/* Returns sector SECTOR of the disk. */
+static void *
+sector_data (uint32_t sector)
+{
+  return disk + (size_t) sector * SECTOR_SIZE;
+}
+
+/* Describes OWNER, as stored in the OWNER array, in a static
+   buffer. */
+static const char *
+owner_name (uint32_t o)
+{
+  static char buf[2][32];
+  static int which;
+
+  which = !which;
+  if (o == OWNER_JOURNAL)
+    return "the journal";
+  else if (o == OWNER_SUPER)
+    return "the superblock";
+  snprintf (buf[which], sizeof buf[which], "inode %"PRIu32, o);
+  return buf[which];
+}
+
+/* Marks the CNT sectors starting at START as used by O.
+   Reports sectors past the end of the disk and sectors that
+   something else already uses.  Returns true if all of the
+   sectors were free, false otherwise. */
+static bool
+claim (uint32_t start, uint32_t cnt, uint32_t o)
+{
+  uint32_t first_dup = 0, dup_cnt = 0, other = NO_OWNER;
+  uint32_t i;
+
+  if (start >= sector_cnt || cnt > sector_cnt - start)
+    {
+      problem (false, "%s: sectors %"PRIu32"-%"PRIu32" are past end of disk",
+               owner_name (o), start, start + cnt - 1);
+      return false;
+    }
+  for (i = 0; i < cnt; i++)
+    {
+      uint32_t *op = &owner[start + i];
+      if (*op == NO_OWNER)
+        *op = o;
+      else if (dup_cnt++ == 0)
+        {
+          first_dup = start + i;
+          other = *op;
+        }
+    }
+  if (dup_cnt > 0)
+    problem (false, "%s: %"PRIu32" sector(s) starting at %"PRIu32
+             " already used by %s", owner_name (o), dup_cnt, first_dup,
+             owner_name (other));
+  return dup_cnt == 0;
+}
+
+/* Replays the transaction in the journal if it was committed but
+   not written home yet, as mounting the file system would. */
+static void
+replay_journal (void)
+{
+  struct journal_header *h = sector_data (JOURNAL_START);
+  struct journal_desc *desc = sector_data (LOG_START);
+  const struct commit_record *commit;
+  uint32_t seq, cnt, desc_cnt, i;
+
+  if (h->magic != HEADER_MAGIC)
+    {
+      problem (false, "journal header is missing");
+      return;
+    }
+
+  seq = h->checkpointed + 1;
+  if (desc->magic != DESC_MAGIC || desc->seq != seq
+      || desc->cnt == 0 || desc->cnt > TXN_MAX)
+    return;
+  cnt = desc->cnt;
+  desc_cnt = (cnt + DESC_SECTORS - 1) / DESC_SECTORS;
+  commit = sector_data (LOG_START + desc_cnt + cnt);
+  if (commit->magic != COMMIT_MAGIC || commit->seq != seq
+      || commit->cnt != cnt)
+    return;
+
+  printf ("replaying journal transaction %"PRIu32", %"PRIu32" sectors\n",
+          seq, cnt);
+  for (i = 0; i < cnt; i++)
+    {
+      uint32_t home;
+
+      desc = sector_data (LOG_START + i / DESC_SECTORS);
+      home = desc->sectors[i % DESC_SECTORS];
+      if (home >= sector_cnt)
+        {
+          problem (false, "journal: sector %"PRIu32" is past end of disk",
+                   home);
+          return;
+        }
+      memcpy (sector_data (home), sector_data (LOG_START + desc_cnt + i),
+              SECTOR_SIZE);
+    }
+  h->checkpointed = seq;
+}
+
+/* Gathers the extents of extent inode D, in SECTOR, owned by the
+   file called NAME, claiming its overflow blocks.  Returns the
+   extents, in a malloc()'d array, and stores their number in
+   *CNTP.  Returns a null pointer if D is too damaged. */
+static struct extent *
+gather_extents (const struct inode_disk *d, uint32_t sector,
+                const char *name, uint32_t *cntp)
+{
+  struct extent *extents;
+  uint32_t cnt = d->extent_cnt, block, i;
+
+  if (cnt > sector_cnt)
+    {
+      problem (false, "%s: inode %"PRIu32" has %"PRIu32" extents",
+               name, sector, cnt);
+      return NULL;
+    }
+  extents = malloc ((cnt > 0 ? cnt : 1) * sizeof *extents);
+  if (extents == NULL)
+    fail_io ("out of memory");
+  memcpy (extents, d->extents,
+          (cnt < INODE_EXTENT_CNT ? cnt : INODE_EXTENT_CNT)
+          * sizeof *extents);
+  block = d->overflow;
+  if (cnt <= INODE_EXTENT_CNT && block != 0)
+    problem (false, "%s: inode %"PRIu32" has an unneeded overflow block",
+             name, sector);
+  for (i = INODE_EXTENT_CNT; i < cnt; i += BLOCK_EXTENT_CNT)
+    {
+      const struct extent_block *b;
+      uint32_t n = cnt - i < BLOCK_EXTENT_CNT ? cnt - i : BLOCK_EXTENT_CNT;
+
+      if (block == 0 || block >= sector_cnt || !claim (block, 1, sector))
+        {
+          problem (false, "%s: inode %"PRIu32" has a broken overflow chain, "
+                   "%"PRIu32" of its %"PRIu32" extents are lost",
+                   name, sector, cnt - i, cnt);
+          cnt = i;
+          break;
+        }
+      b = sector_data (block);
+      memcpy (extents + i, b->extents, n * sizeof *extents);
+      block = b->next;
+    }
+  *cntp = cnt;
+  return extents;
+}
+
+/* Adds data sector SECTOR, which holds file sector IDX, to the
+   *CNTP extents in *EXTENTSP, which has room for *CAPP, either
+   by growing the last extent or as a new one.  IDX must be past
+   the end of the last extent. */
+static void
+add_sector (struct extent **extentsp, uint32_t *cntp, uint32_t *capp,
+            uint32_t idx, uint32_t sector)
+{
+  struct extent *e = *cntp > 0 ? &(*extentsp)[*cntp - 1] : NULL;
+
+  if (e != NULL && e->offset + e->length == idx
+      && e->start + e->length == sector)
+    {
+      e->length++;
+      return;
+    }
+  if (*cntp == *capp)
+    {
+      *capp = *capp * 2 + 16;
+      *extentsp = realloc (*extentsp, *capp * sizeof **extentsp);
+      if (*extentsp == NULL)
+        fail_io ("out of memory");
+    }
+  e = &(*extentsp)[(*cntp)++];
+  e->offset = idx;
+  e->start = sector;
+  e->length = 1;
+}
+
+/* Gathers the data sectors of indexed inode D, in SECTOR, owned
+   by the file called NAME, into extents, claiming its pointer
+   blocks.  Returns the extents, in a malloc()'d array, and stores
+   their number in *CNTP. */
+static struct extent *
+gather_indexed (const struct inode_disk *d, uint32_t sector,
+                const char *name, uint32_t *cntp)
+{
+  struct extent *extents = NULL;
+  uint32_t cnt = 0, cap = 0;
+  uint32_t blocks[PTRS_PER_SECTOR + 1];
+  uint32_t block_cnt = 0;
+  uint32_t i, j;
+
+  for (i = 0; i < DIRECT_CNT; i++)
+    if (d->direct[i] != 0)
+      add_sector (&extents, &cnt, &cap, i, d->direct[i]);
+
+  /* The indirect block, then the indirect blocks that the doubly
+     indirect block points to, each covering PTRS_PER_SECTOR file
+     sectors in order. */
+  blocks[block_cnt++] = d->indirect;
+  if (d->doubly_indirect != 0)
+    {
+      if (claim (d->doubly_indirect, 1, sector))
+        memcpy (blocks + block_cnt, sector_data (d->doubly_indirect),
+                PTRS_PER_SECTOR * sizeof *blocks);
+      else
+        {
+          problem (false, "%s: inode %"PRIu32" has a bad doubly indirect "
+                   "block", name, sector);
+          memset (blocks + block_cnt, 0, PTRS_PER_SECTOR * sizeof *blocks);
+        }
+    }
+  else
+    memset (blocks + block_cnt, 0, PTRS_PER_SECTOR * sizeof *blocks);
+  block_cnt += PTRS_PER_SECTOR;
+
+  for (i = 0; i < block_cnt; i++)
+    {
+      const uint32_t *ptrs;
+
+      if (blocks[i] == 0)
+        continue;
+      if (!claim (blocks[i], 1, sector))
+        {
+          problem (false, "%s: inode %"PRIu32" has a bad pointer block",
+                   name, sector);
+          continue;
+        }
+      ptrs = sector_data (blocks[i]);
+      for (j = 0; j < PTRS_PER_SECTOR; j++)
+        if (ptrs[j] != 0)
+          add_sector (&extents, &cnt, &cap,
+                      DIRECT_CNT + i * PTRS_PER_SECTOR + j, ptrs[j]);
+    }
+
+  if (extents == NULL)
+    {
+      extents = malloc (sizeof *extents);
+      if (extents == NULL)
+        fail_io ("out of memory");
+    }
+  *cntp = cnt;
+  return extents;
+}
+
+/* Checks the inode in SECTOR, owned by the file called NAME, and
+   claims it, its overflow or pointer blocks and its data sectors.
+   Returns
+   its extents, in a malloc()'d array, and stores their number in
+   *CNTP.  Returns a null pointer if SECTOR is not an inode. */
+static struct extent *
+check_inode (uint32_t sector, const char *name, uint32_t *cntp)
+{
+  const struct inode_disk *d;
+  struct extent *extents;
+  uint32_t cnt, i, end;
+
+  *cntp = 0;
+  if (sector >= sector_cnt)
+    {
+      problem (false, "%s: inode %"PRIu32" is past end of disk",
+               name, sector);
+      return NULL;
+    }
+  d = sector_data (sector);
+  if (d->magic != INODE_MAGIC)
+    {
+      problem (false, "%s: sector %"PRIu32" is not an inode", name, sector);
+      return NULL;
+    }
+  if (!claim (sector, 1, sector))
+    return NULL;
+  inode_cnt++;
+
+  if (d->length < 0)
+    problem (false, "%s: inode %"PRIu32" has negative length", name, sector);
+  if (d->layout != LAYOUT_EXTENTS
+      && (d->extent_cnt != 0 || d->overflow != 0))
+    problem (false, "%s: inode %"PRIu32" has extents it does not use",
+             name, sector);
+  if (d->layout == LAYOUT_INLINE)
+    {
+      if (d->length > (int32_t) INLINE_MAX)
+        problem (false, "%s: inline inode %"PRIu32" is %"PRId32" bytes long",
+                 name, sector, d->length);
+      return calloc (1, sizeof *extents);
+    }
+  else if (d->layout == LAYOUT_EXTENTS)
+    extents = gather_extents (d, sector, name, &cnt);
+  else if (d->layout == LAYOUT_INDEXED)
+    extents = gather_indexed (d, sector, name, &cnt);
+  else
+    {
+      problem (false, "%s: inode %"PRIu32" has unknown layout %"PRIu32,
+               name, sector, d->layout);
+      return NULL;
+    }
+  if (extents == NULL)
+    return NULL;
+
+  /* Check the extents and claim their sectors.  They must be in
+     order of file offset without overlapping, and lie within the
+     file. */
+  end = 0;
+  for (i = 0; i < cnt; i++)
+    {
+      struct extent *e = &extents[i];
+
+      if (e->length == 0 || e->offset < end
+          || e->offset + e->length < e->offset)
+        {
+          problem (false, "%s: inode %"PRIu32" extent %"PRIu32" is invalid",
+                   name, sector, i);
+          e->length = 0;
+          continue;
+        }
+      end = e->offset + e->length;
+      if (!claim (e->start, e->length, sector))
+        e->length = 0;
+    }
+  if (d->length >= 0
+      && (uint64_t) end * SECTOR_SIZE
+         >= (uint64_t) d->length + SECTOR_SIZE)
+    problem (false, "%s: inode %"PRIu32" has sectors past end of file",
+             name, sector);
+
+  *cntp = cnt;
+  return extents;
+}
+
+/* Returns the disk sector that holds file sector IDX of a file
+   with the CNT extents in EXTENTS, or 0 if it is in a hole. */
+static uint32_t
+file_sector (const struct extent *extents, uint32_t cnt, uint32_t idx)
+{
+  uint32_t lo = 0, hi = cnt;
+
+  while (lo < hi)
+    {
+      uint32_t mid = lo + (hi - lo) / 2;
+      if (extents[mid].offset <= idx)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  if (lo > 0)
+    {
+      const struct extent *e = &extents[lo - 1];
+      if (idx < e->offset + e->length)
+        return e->start + (idx - e->offset);
+    }
+  return 0;
+}
+
+/* Checks directory entry E and the file it names. */
+static void
+check_entry (const struct dir_entry *e)
+{
+  struct extent *extents;
+  char name[NAME_MAX + 1];
+  uint32_t cnt;
+
+  if (!e->in_use)
+    return;
+  if (memchr (e->name, '\0', sizeof e->name) == NULL || e->name[0] == '\0')
+    {
+      problem (false, "directory entry for inode %"PRIu32" has a bad name",
+               e->inode_sector);
+      return;
+    }
+  strcpy (name, e->name);
+  extents = check_inode (e->inode_sector, name, &cnt);
+  free (extents);
+}
+
+/* Checks the root directory and every file in it. */
+static void
+check_root (void)
+{
+  const struct inode_disk *d = sector_data (ROOT_DIR_SECTOR);
+  const struct dir_header *h = NULL;
+  struct extent *extents;
+  uint32_t cnt, i;
+
+  extents = check_inode (ROOT_DIR_SECTOR, "root directory", &cnt);
+  if (extents == NULL)
+    return;
+
+  /* As in the kernel, a directory is hashed if its first sector
+     holds a header and linear otherwise. */
+  if (d->layout != LAYOUT_INLINE && d->length >= SECTOR_SIZE)
+    {
+      uint32_t sector = file_sector (extents, cnt, 0);
+
+      h = sector != 0 ? sector_data (sector) : NULL;
+      if (h != NULL && h->magic != DIR_MAGIC)
+        h = NULL;
+    }
+
+  if (h == NULL)
+    {
+      /* A linear directory: an array of entries in its inode or
+         in its first sector.  It can be longer than that after a
+         failed conversion to a hash table, but only with zeros. */
+      const uint8_t *data = d->inline_data;
+      uint32_t sector = file_sector (extents, cnt, 0);
+      uint32_t length = d->length > 0 ? (uint32_t) d->length : 0;
+
+      if (d->layout != LAYOUT_INLINE)
+        {
+          data = sector != 0 ? sector_data (sector) : NULL;
+          if (length > SECTOR_SIZE)
+            length = SECTOR_SIZE;
+        }
+      for (i = 0; data != NULL
+                  && (i + 1) * sizeof (struct dir_entry) <= length; i++)
+        check_entry ((const struct dir_entry *) data + i);
+    }
+  else
+    {
+      /* A hashed directory: a header, then one bucket per sector,
+         each in the sector after the last.  Looking only at the
+         sectors that exist skips the buckets that are holes. */
+      uint32_t entry_cnt = 0;
+
+      for (i = 0; i < cnt; i++)
+        {
+          const struct extent *e = &extents[i];
+          uint32_t j;
+
+          for (j = 0; j < e->length; j++)
+            {
+              uint32_t idx = e->offset + j;
+              const struct dir_entry *bucket;
+              size_t k;
+
+              if (idx == 0 || idx > h->bucket_cnt)
+                continue;
+              bucket = sector_data (e->start + j);
+              for (k = 0; k < ENTRIES_PER_BUCKET; k++)
+                {
+                  entry_cnt += bucket[k].in_use != 0;
+                  check_entry (&bucket[k]);
+                }
+            }
+        }
+      if (entry_cnt != h->entry_cnt)
+        problem (false, "root directory has %"PRIu32" entries, "
+                 "but its header says %"PRIu32, entry_cnt, h->entry_cnt);
+    }
+  free (extents);
+}
+
+/* Returns true if bit SECTOR of the free map is set.  FM_DATA
+   points to each sector's worth of the free map file, or is null
+   where the file has no sector. */
+static bool
+marked_used (uint8_t *const *fm_data, uint32_t sector)
+{
+  uint32_t idx = sector / (SECTOR_SIZE * 8);
+  uint32_t bit = sector % (SECTOR_SIZE * 8);
+
+  if (fm_data[idx] == NULL)
+    return false;
+  return (fm_data[idx][bit / 8] >> (bit % 8)) & 1;
+}
+
+/* Reports the sectors from FIRST up to END that are marked in use
+   in the free map but not used (if LEAKED) or the other way
+   around. */
+static void
+report_run (uint32_t first, uint32_t end, bool leaked)
+{
+  const char *what = (leaked ? "marked in use but not used"
+                      : "used but marked free");
+
+  if (end - first == 1)
+    problem (true, "sector %"PRIu32": %s", first, what);
+  else
+    problem (true, "sectors %"PRIu32"-%"PRIu32": %s", first, end - 1, what);
+}
+
+/* Compares the free map with the sectors actually used, and
+   rewrites it if REPAIR is true.  Stores the number of free
+   sectors into *FREE_CNTP.  Returns false if the free map file
+   itself is too damaged to check or rewrite.
+
+   On a disk small enough, the free map fits in its inode, and so
+   is checked and rewritten there. */
+static bool
+check_free_map (bool repair, uint32_t *free_cntp)
+{
+  struct inode_disk *d = sector_data (FREE_MAP_SECTOR);
+  bool is_inline = d->layout == LAYOUT_INLINE;
+  uint32_t bytes = (sector_cnt + 31) / 32 * 4;
+  uint32_t fm_cnt = (bytes + SECTOR_SIZE - 1) / SECTOR_SIZE;
+  uint32_t fm_size = is_inline ? INLINE_MAX : SECTOR_SIZE;
+  uint8_t **fm_data;
+  struct extent *extents;
+  uint32_t cnt, free_cnt, i;
+  uint32_t run_start = 0;
+  int run = 0;                  /* 1: leaked, -1: marked free, 0: none. */
+
+  extents = check_inode (FREE_MAP_SECTOR, "free map", &cnt);
+  if (extents == NULL)
+    return false;
+  if (d->length != (int32_t) bytes || (is_inline && bytes > INLINE_MAX))
+    {
+      problem (false, "free map is %"PRId32" bytes long, expected %"PRIu32,
+               d->length, bytes);
+      free (extents);
+      return false;
+    }
+  fm_data = calloc (fm_cnt, sizeof *fm_data);
+  if (fm_data == NULL)
+    fail_io ("out of memory");
+  if (is_inline)
+    fm_data[0] = d->inline_data;
+  else
+    for (i = 0; i < fm_cnt; i++)
+      {
+        uint32_t sector = file_sector (extents, cnt, i);
+
+        if (sector != 0)
+          fm_data[i] = sector_data (sector);
+        else
+          problem (false, "free map sector %"PRIu32" is missing", i);
+      }
+  free (extents);
+
+  /* Compare, reporting runs of mismatches at a time. */
+  free_cnt = 0;
+  for (i = 0; i <= sector_cnt; i++)
+    {
+      int state = 0;
+
+      if (i < sector_cnt)
+        {
+          bool used = owner[i] != NO_OWNER;
+          bool marked = marked_used (fm_data, i);
+
+          free_cnt += !used;
+          state = marked && !used ? 1 : !marked && used ? -1 : 0;
+        }
+      if (state != run)
+        {
+          if (run != 0)
+            report_run (run_start, i, run > 0);
+          run = state;
+          run_start = i;
+        }
+    }
+
+  /* Rewrite the whole free map, including the tail of its last
+     sector or of its inline data, which must be zeros. */
+  if (repair)
+    for (i = 0; i < fm_cnt; i++)
+      if (fm_data[i] != NULL)
+        {
+          uint8_t *data = fm_data[i];
+          uint32_t j;
+
+          memset (data, 0, fm_size);
+          for (j = 0; j < fm_size * 8; j++)
+            {
+              uint32_t sector = i * SECTOR_SIZE * 8 + j;
+              if (sector < sector_cnt && owner[sector] != NO_OWNER)
+                data[j / 8] |= 1 << (j % 8);
+            }
+        }
+  free (fm_data);
+  *free_cntp = free_cnt;
+  return true;
+}
+
+/* Checks the superblock against FREE_CNT, the number of free
+   sectors, and updates it if REPAIR is true. */
+static void
+check_super (uint32_t free_cnt, bool repair)
+{
+  struct superblock *s = sector_data (SUPER_SECTOR);
+
+  if (s->magic != SUPER_MAGIC)
+    {
+      problem (false, "superblock is missing");
+      return;
+    }
+  if (s->sector_cnt != sector_cnt)
+    problem (false, "superblock says %"PRIu32" sectors, disk has %"PRIu32,
+             s->sector_cnt, sector_cnt);
+  if (!s->clean)
+    printf ("file system was not unmounted cleanly\n");
+  else if (s->free_cnt != free_cnt)
+    problem (true, "superblock says %"PRIu32" sectors free, "
+             "actually %"PRIu32, s->free_cnt, free_cnt);
+  if (repair)
+    {
+      s->free_cnt = free_cnt;
+      s->clean = 1;
+    }
+}
+
+static void
+usage (int exit_code)
+{
+  printf ("pintos-fsck, a utility for checking Pintos file system disks\n"
+          "Usage: pintos-fsck [-r] DISKFILE\n"
+          "where DISKFILE is the file system disk (hd0:1).\n"
+          "Options:\n"
+          "  -r, --repair      Replay the journal, rebuild the free map\n"
+          "                    and update the superblock.\n"
+          "  -h, --help        Display this help message.\n"
+          "Exit status is 0 if no problems were found, 1 if all the\n"
+          "problems found were repaired, 4 if some are left, or 8 if\n"
+          "the disk could not be checked.\n");
+  exit (exit_code);
+}
+
+int
+main (int argc, char *argv[])
+{
+  static const struct option options[] =
+    {
+      {"repair", no_argument, NULL, 'r'},
+      {"help", no_argument, NULL, 'h'},
+      {NULL, 0, NULL, 0},
+    };
+  bool repair = false;
+  uint32_t free_cnt = 0, i;
+  struct stat st;
+  int fd, c;
+
+  while ((c = getopt_long (argc, argv, "rh", options, NULL)) != -1)
+    switch (c)
+      {
+      case 'r':
+        repair = true;
+        break;
+      case 'h':
+        usage (0);
+      default:
+        usage (8);
+      }
+  if (optind != argc - 1)
+    usage (8);
+  disk_name = argv[optind];
+
+  /* Map the disk, privately unless repairing. */
+  fd = open (disk_name, repair ? O_RDWR : O_RDONLY);
+  if (fd < 0)
+    fail_io ("%s: open", disk_name);
+  if (fstat (fd, &st) < 0)
+    fail_io ("%s: stat", disk_name);
+  sector_cnt = st.st_size / SECTOR_SIZE;
+  if (sector_cnt <= SUPER_SECTOR)
+    {
+      errno = 0;
+      fail_io ("%s: too small for a file system", disk_name);
+    }
+  disk = mmap (NULL, (size_t) sector_cnt * SECTOR_SIZE,
+               PROT_READ | PROT_WRITE, repair ? MAP_SHARED : MAP_PRIVATE,
+               fd, 0);
+  if (disk == MAP_FAILED)
+    fail_io ("%s: mmap", disk_name);
+
+  owner = malloc ((size_t) sector_cnt * sizeof *owner);
+  if (owner == NULL)
+    fail_io ("out of memory");
+  for (i = 0; i < sector_cnt; i++)
+    owner[i] = NO_OWNER;
+
+  replay_journal ();
+
+  /* Find every sector in use. */
+  claim (JOURNAL_START, JOURNAL_SECTORS, OWNER_JOURNAL);
+  claim (SUPER_SECTOR, 1, OWNER_SUPER);
+  check_root ();
+
+  /* The free map's own sectors count as used, so check it last.
+     Without it there is no free count for the superblock. */
+  if (check_free_map (repair, &free_cnt))
+    check_super (free_cnt, repair);
+  else
+    repair = false;
+
+  if (repair && msync (disk, (size_t) sector_cnt * SECTOR_SIZE, MS_SYNC) < 0)
+    fail_io ("%s: msync", disk_name);
+
+  printf ("%s: %"PRIu32" sectors, %"PRIu32" free, %lu inodes, "
+          "%lu problems%s\n", disk_name, sector_cnt, free_cnt, inode_cnt,
+          problem_cnt, repair ? ", free map rebuilt" : "");
+  if (problem_cnt == 0)
+    return 0;
+  return repair && fixable_cnt == problem_cnt ? 1 : 4;
+}
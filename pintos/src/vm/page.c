@@ -0,0 +1,367 @@
+#include "vm/page.h"
+#include <debug.h>
+#include <string.h>
+#include "filesys/file.h"
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+#include "userprog/pagedir.h"
+
+/* A frame full of zeros, shared read-only by every page that
+   has not been written since it was created.  Large bss
+   regions are mostly read before they are written, if they are
+   touched at all, so they cost no memory and no zeroing until
+   then. */
+static void *zero_frame;
+
+static hash_hash_func page_hash;
+static hash_less_func page_less;
+static hash_action_func page_destroy;
+static struct page *page_lookup (const void *upage);
+static struct page *page_add (void *upage, bool writable);
+static void page_remove (struct page *);
+static bool page_in_zero (struct page *);
+static bool page_in_file (struct page *);
+static size_t collect_run (struct page *, struct page **run, size_t max);
+static size_t read_run (struct page **run, size_t cnt);
+
+/* Initializes the page module. */
+void
+page_init (void)
+{
+  zero_frame = palloc_get_page (PAL_ASSERT | PAL_ZERO);
+}
+
+/* Creates an empty supplemental page table for the current
+   process.  Returns true if successful, false if memory
+   allocation fails. */
+bool
+page_table_create (void)
+{
+  struct thread *t = thread_current ();
+
+  ASSERT (t->pages == NULL);
+
+  list_init (&t->file_maps);
+  t->pages = malloc (sizeof *t->pages);
+  if (t->pages == NULL)
+    return false;
+  if (!hash_init (t->pages, page_hash, page_less, NULL))
+    {
+      free (t->pages);
+      t->pages = NULL;
+      return false;
+    }
+  return true;
+}
+
+/* Destroys the current process's supplemental page table.
+   Must be called before the process's page directory is
+   destroyed, because pagedir_destroy() would otherwise free the
+   shared zero frame. */
+void
+page_table_destroy (void)
+{
+  struct thread *t = thread_current ();
+
+  if (t->pages != NULL)
+    {
+      hash_destroy (t->pages, page_destroy);
+      free (t->pages);
+      t->pages = NULL;
+
+      while (!list_empty (&t->file_maps))
+        {
+          struct list_elem *e = list_pop_front (&t->file_maps);
+          struct file_map *map = list_entry (e, struct file_map, elem);
+          file_close (map->file);
+          free (map);
+        }
+    }
+}
+
+/* Creates a file map for pages of the current process backed by
+   FILE, which the map keeps open independently of the caller.
+   Returns the new map, or a null pointer if memory allocation
+   fails. */
+struct file_map *
+page_map_file (struct file *file)
+{
+  struct thread *t = thread_current ();
+  struct file_map *map = malloc (sizeof *map);
+
+  if (map == NULL)
+    return NULL;
+  map->file = file_reopen (file);
+  if (map->file == NULL)
+    {
+      free (map);
+      return NULL;
+    }
+  map->next_fault = NULL;
+  list_push_back (&t->file_maps, &map->elem);
+  return map;
+}
+
+/* Adds UPAGE to the current process as a page of zeros, mapped
+   to the shared zero frame.  If WRITABLE, the first write to it
+   faults and page_fault_in() gives it a private frame.
+   Returns true if successful, false if UPAGE is already mapped
+   or memory allocation fails. */
+bool
+page_add_zero (void *upage, bool writable)
+{
+  struct page *p = page_add (upage, writable);
+
+  if (p == NULL)
+    return false;
+  if (!pagedir_set_page (thread_current ()->pagedir, upage, zero_frame,
+                         false))
+    {
+      page_remove (p);
+      return false;
+    }
+  return true;
+}
+
+/* Adds UPAGE to the current process as a page whose first
+   READ_BYTES bytes are read from MAP's file at offset OFS, with
+   the rest zeroed.  Nothing is read until the page is first
+   accessed.
+   Returns true if successful, false if UPAGE is already mapped
+   or memory allocation fails. */
+bool
+page_add_file (struct file_map *map, void *upage, off_t ofs,
+               uint32_t read_bytes, bool writable)
+{
+  struct page *p;
+
+  ASSERT (read_bytes <= PGSIZE);
+
+  p = page_add (upage, writable);
+  if (p == NULL)
+    return false;
+  p->map = map;
+  p->ofs = ofs;
+  p->read_bytes = read_bytes;
+  return true;
+}
+
+/* Tries to resolve a page fault at FAULT_ADDR in the current
+   process, caused by a write if WRITE is true, by a read
+   otherwise.  Returns true if the faulting access can be
+   retried, false if it is a genuine error. */
+bool
+page_fault_in (const void *fault_addr, bool write)
+{
+  struct thread *t = thread_current ();
+  struct page *p;
+
+  if (t->pages == NULL || !is_user_vaddr (fault_addr))
+    return false;
+  p = page_lookup (pg_round_down (fault_addr));
+  if (p == NULL || p->kpage != NULL || (write && !p->writable))
+    return false;
+
+  if (p->map != NULL)
+    return page_in_file (p);
+  else
+    return write && page_in_zero (p);
+}
+
+/* Gives zero page P, which has just been written for the first
+   time, a private frame.  Returns true if successful. */
+static bool
+page_in_zero (struct page *p)
+{
+  uint32_t *pd = thread_current ()->pagedir;
+  void *kpage = palloc_get_page (PAL_USER | PAL_ZERO);
+
+  if (kpage == NULL)
+    return false;
+  pagedir_clear_page (pd, p->upage);
+  if (!pagedir_set_page (pd, p->upage, kpage, true))
+    {
+      palloc_free_page (kpage);
+      return false;
+    }
+  p->kpage = kpage;
+  return true;
+}
+
+/* Reads file-backed page P, which has just been accessed for the
+   first time, from its file.  Returns true if successful.
+
+   If P is the page just after the one that faulted last in the
+   same file map, the process is probably streaming through the
+   file, so up to PAGE_READAHEAD following pages are read along
+   with P, in a single file_read_at() into contiguous frames.
+   Pintos has no asynchronous disk requests, so the read ahead is
+   done while handling this fault; it saves the later faults and
+   turns many one-page reads into one larger one. */
+static bool
+page_in_file (struct page *p)
+{
+  struct page *run[PAGE_READAHEAD + 1];
+  size_t cnt, loaded;
+
+  cnt = 1;
+  run[0] = p;
+  if (p->upage == p->map->next_fault)
+    cnt = collect_run (p, run, PAGE_READAHEAD + 1);
+
+  /* Fall back to just P if we can't get memory for the rest. */
+  loaded = read_run (run, cnt);
+  if (loaded == 0 && cnt > 1)
+    loaded = read_run (run, 1);
+  if (loaded == 0)
+    return false;
+
+  p->map->next_fault = (uint8_t *) p->upage + loaded * PGSIZE;
+  return true;
+}
+
+/* Stores in RUN[] up to MAX pages, starting with P, that can be
+   read from P's file with one read: consecutive unloaded pages
+   in the same file map, at consecutive file offsets, all full
+   pages except possibly the last.  Returns the number stored. */
+static size_t
+collect_run (struct page *p, struct page **run, size_t max)
+{
+  size_t cnt = 1;
+
+  run[0] = p;
+  while (cnt < max && run[cnt - 1]->read_bytes == PGSIZE)
+    {
+      struct page *prev = run[cnt - 1];
+      struct page *next = page_lookup ((uint8_t *) prev->upage + PGSIZE);
+
+      if (next == NULL || next->map != p->map || next->kpage != NULL
+          || next->ofs != prev->ofs + PGSIZE)
+        break;
+      run[cnt++] = next;
+    }
+  return cnt;
+}
+
+/* Reads the CNT pages in RUN[], as found by collect_run(), into
+   newly allocated frames and maps them.  Returns the number of
+   pages mapped, which is 0 on failure. */
+static size_t
+read_run (struct page **run, size_t cnt)
+{
+  uint32_t *pd = thread_current ()->pagedir;
+  struct file *file = run[0]->map->file;
+  off_t size = (cnt - 1) * PGSIZE + run[cnt - 1]->read_bytes;
+  uint8_t *kpages;
+  size_t i;
+
+  kpages = palloc_get_multiple (PAL_USER, cnt);
+  if (kpages == NULL)
+    return 0;
+  if (file_read_at (file, kpages, size, run[0]->ofs) != size)
+    {
+      palloc_free_multiple (kpages, cnt);
+      return 0;
+    }
+  memset (kpages + size, 0, cnt * PGSIZE - size);
+
+  /* Pages are freed one at a time later, by pagedir_destroy(). */
+  for (i = 0; i < cnt; i++)
+    {
+      void *kpage = kpages + i * PGSIZE;
+
+      if (!pagedir_set_page (pd, run[i]->upage, kpage, run[i]->writable))
+        {
+          palloc_free_multiple (kpage, cnt - i);
+          break;
+        }
+      run[i]->kpage = kpage;
+    }
+  return i;
+}
+
+/* Adds a page for UPAGE to the current process's supplemental
+   page table and returns it, or returns a null pointer if UPAGE
+   is already present or memory allocation fails. */
+static struct page *
+page_add (void *upage, bool writable)
+{
+  struct thread *t = thread_current ();
+  struct page *p;
+
+  ASSERT (pg_ofs (upage) == 0);
+  ASSERT (is_user_vaddr (upage));
+
+  if (pagedir_get_page (t->pagedir, upage) != NULL)
+    return NULL;
+
+  p = malloc (sizeof *p);
+  if (p == NULL)
+    return NULL;
+  p->upage = upage;
+  p->writable = writable;
+  p->kpage = NULL;
+  p->map = NULL;
+  if (hash_insert (t->pages, &p->hash_elem) != NULL)
+    {
+      free (p);
+      return NULL;
+    }
+  return p;
+}
+
+/* Removes P, which must not be mapped, from the current
+   process's supplemental page table and frees it. */
+static void
+page_remove (struct page *p)
+{
+  hash_delete (thread_current ()->pages, &p->hash_elem);
+  free (p);
+}
+
+/* Returns the current process's page for UPAGE,
+   or a null pointer if there is none. */
+static struct page *
+page_lookup (const void *upage)
+{
+  struct page p;
+  struct hash_elem *e;
+
+  p.upage = (void *) upage;
+  e = hash_find (thread_current ()->pages, &p.hash_elem);
+  return e != NULL ? hash_entry (e, struct page, hash_elem) : NULL;
+}
+
+/* Returns a hash value for page P. */
+static unsigned
+page_hash (const struct hash_elem *p_, void *aux UNUSED)
+{
+  const struct page *p = hash_entry (p_, struct page, hash_elem);
+  return hash_bytes (&p->upage, sizeof p->upage);
+}
+
+/* Returns true if page A precedes page B. */
+static bool
+page_less (const struct hash_elem *a_, const struct hash_elem *b_,
+           void *aux UNUSED)
+{
+  const struct page *a = hash_entry (a_, struct page, hash_elem);
+  const struct page *b = hash_entry (b_, struct page, hash_elem);
+
+  return a->upage < b->upage;
+}
+
+/* Frees page P.  A zero page still on the shared zero frame is
+   unmapped first, so that pagedir_destroy() leaves the zero
+   frame alone; private frames are freed by pagedir_destroy(). */
+static void
+page_destroy (struct hash_elem *p_, void *aux UNUSED)
+{
+  struct page *p = hash_entry (p_, struct page, hash_elem);
+
+  if (p->kpage == NULL && p->map == NULL)
+    pagedir_clear_page (thread_current ()->pagedir, p->upage);
+  free (p);
+}
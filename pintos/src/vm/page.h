@@ -0,0 +1,53 @@
+#ifndef VM_PAGE_H
+#define VM_PAGE_H
+
+#include <hash.h>
+#include <list.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "filesys/off_t.h"
+
+/* Maximum number of pages read ahead of a sequential page
+   fault. */
+#define PAGE_READAHEAD 8
+
+/* A run of pages backed by one file, e.g. an executable segment.
+   Remembers where the last fault in the run left off, to detect
+   sequential access. */
+struct file_map
+  {
+    struct list_elem elem;              /* Element in thread's `file_maps'. */
+    struct file *file;                  /* Backing file. */
+    void *next_fault;                   /* Next page if access is sequential. */
+  };
+
+/* A user page tracked by the supplemental page table.
+
+   The hardware page table only records where a page currently
+   lives.  This records what the page is supposed to contain, so
+   that the page fault handler can bring it in. */
+struct page
+  {
+    struct hash_elem hash_elem;         /* Element in thread's `pages'. */
+    void *upage;                        /* User virtual address. */
+    bool writable;                      /* Writable by the process? */
+    void *kpage;                        /* Private frame, or null. */
+
+    /* File-backed pages only; MAP is null for zero pages. */
+    struct file_map *map;               /* Backing file. */
+    off_t ofs;                          /* Offset in file. */
+    uint32_t read_bytes;                /* Bytes to read, rest zeroed. */
+  };
+
+void page_init (void);
+
+bool page_table_create (void);
+void page_table_destroy (void);
+
+struct file_map *page_map_file (struct file *);
+bool page_add_zero (void *upage, bool writable);
+bool page_add_file (struct file_map *, void *upage, off_t ofs,
+                    uint32_t read_bytes, bool writable);
+bool page_fault_in (const void *fault_addr, bool write);
+
+#endif /* vm/page.h */